@@ -0,0 +1,134 @@
+
+#include <iostream>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "libusbcpp_broker.h"
+
+// A device_broker lets many local processes share one device: The broker owns the device and publishes everything
+// it reads into shared memory, the clients read it from there without copying and send OUT requests back.
+//
+// With a real device it looks like this:
+//
+//      usb::broker_config config;
+//      config.in_endpoint = 0x81;
+//      config.out_endpoint = 0x01;
+//      usb::device_broker broker(device, "my_board", config);
+//      broker.run_async();
+//
+// and in every other process:
+//
+//      usb::broker_client client("my_board");
+//      if (auto message = client.acquire()) {
+//          ... use message->data, message->length ...
+//          ... message->more is set if the next message continues this one (larger than slot_size) ...
+//          client.release();
+//      }
+//
+// This example benchmarks the fan-out without a device: The broker publishes synthetic messages at a fixed rate,
+// roughly what a SuperSpeed bulk endpoint delivers, and an increasing number of client processes read them.
+
+static const char* BROKER_NAME = "fanout_benchmark";
+static const size_t MESSAGE_COUNT = 400000;
+static const size_t MESSAGE_SIZE = 4096;
+static const double PUBLISH_RATE = 400e6;     // [bytes/s]
+
+struct reader_result {
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    double seconds = 0;
+};
+
+static void run_reader() {
+    usb::broker_client client(BROKER_NAME);
+    client.send(std::string("ready"));
+
+    reader_result result;
+    uint64_t checksum = 0;
+    std::chrono::steady_clock::time_point start;
+    while (true) {
+        auto message = client.acquire();
+        if (!message) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        bool end = message->length == 1;
+        checksum += message->data[0];       // Touch the data, it is read directly from shared memory
+        if (client.release()) {
+            if (result.received++ == 0) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+        if (end)
+            break;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.lost = client.lost();
+
+    // Report back to the broker through the OUT queue
+    while (!client.send((const uint8_t*)&result, sizeof(result))) {
+        std::this_thread::yield();
+    }
+}
+
+int main() {
+
+    printf("Publishing %zu messages of %zu bytes at %.0f MB/s\n", MESSAGE_COUNT, MESSAGE_SIZE, PUBLISH_RATE / 1e6);
+    printf("readers | received/reader | lost/reader | per reader [MB/s] | fan-out total [MB/s]\n");
+
+    for (int readers : { 1, 2, 4, 8 }) {
+        usb::broker_config config;
+        config.slot_count = 4096;
+        config.slot_size = MESSAGE_SIZE;
+        usb::device_broker broker(BROKER_NAME, config);
+
+        for (int i = 0; i < readers; i++) {
+            if (fork() == 0) {
+                run_reader();
+                _exit(0);
+            }
+        }
+
+        int ready = 0;
+        while (ready < readers) {
+            ready += (int)broker.poll_requests([] (const uint8_t*, size_t) {});
+        }
+
+        std::vector<uint8_t> message(MESSAGE_SIZE, 0xAB);
+        auto interval = std::chrono::duration<double>(MESSAGE_SIZE / PUBLISH_RATE);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < MESSAGE_COUNT; i++) {
+            while (std::chrono::steady_clock::now() - start < i * interval);     // Pace like a device would
+            memcpy(message.data(), &i, sizeof(i));
+            broker.publish(message.data(), message.size());
+        }
+        uint8_t end = 0;
+        broker.publish(&end, 1);
+
+        std::vector<reader_result> results;
+        while (results.size() < (size_t)readers) {
+            broker.poll_requests([&] (const uint8_t* data, size_t length) {
+                if (length == sizeof(reader_result)) {
+                    reader_result result;
+                    memcpy(&result, data, sizeof(result));
+                    results.push_back(result);
+                }
+            });
+            std::this_thread::yield();
+        }
+        while (wait(nullptr) > 0);
+
+        double received = 0, lost = 0, rate = 0, slowest = 0;
+        for (auto& result : results) {
+            received += (double)result.received;
+            lost += (double)result.lost;
+            rate += (double)result.received * MESSAGE_SIZE / result.seconds / 1e6;
+            slowest = std::max(slowest, result.seconds);
+        }
+        printf("%7d | %15.0f | %11.0f | %17.1f | %20.1f\n", readers, received / readers, lost / readers,
+               rate / readers, received * MESSAGE_SIZE / slowest / 1e6);
+    }
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <iostream>
+#include "libusbcpp.h"
+#include "libusbcpp_context_pool.h"
+
+// Measures how many transfer completions per second all matching devices reach together,
+// depending on the number of libusb contexts (shards) the devices are spread over.
+// Plug in as many devices as you can, ideally behind several hubs. The numbers only mean something with real
+// hardware, there are no reference results yet.
+
+int main() {
+
+    //usb::enable_logging(true/false);
+
+    // You will have to choose something that fits your device for testing.
+    int vid = 0x1209;
+    int pid = 0x0D32;
+    auto duration = std::chrono::seconds(5);
+
+    size_t max_shards = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t shards = 1; shards <= max_shards; shards *= 2) {
+        usb::context_pool_config pool_config;
+        pool_config.shards = shards;
+        pool_config.placement = usb::shard_placement::BY_HUB;
+        for (size_t i = 0; i < shards; i++) {
+            pool_config.threads.cpus.push_back((int)i);     // One core per event thread
+        }
+        usb::context_pool pool(pool_config);
+
+        std::vector<usb::device> devices = pool.find_devices(vid, pid);
+        if (devices.empty()) {
+            printf("No device found :(\n");
+            return 0;
+        }
+
+        // Fixed parameters, so that only the sharding changes between runs
+        usb::stream_config config;
+        config.auto_tune = false;
+        config.transfer_size = 16 * 1024;
+        config.queue_depth = 8;
+        config.handle_events = false;       // The shard threads handle the events
+
+        std::atomic<uint64_t> completions = 0;
+        std::atomic<uint64_t> bytes = 0;
+        auto end = std::chrono::steady_clock::now() + duration;
+
+        // A stream blocks its caller, so every device needs a thread. They only sleep and run the callbacks,
+        // the shard threads do the event handling.
+        std::vector<std::thread> threads;
+        for (auto& device : devices) {
+            const usb::endpoint_info* ep = device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN);
+            if (!ep || !device->claim_interface(ep->interface_number))
+                continue;
+
+            uint8_t address = ep->address;
+            threads.emplace_back([&, device, address] {
+                device->stream_read(address, [&] (const uint8_t*, size_t length) {
+                    completions.fetch_add(1, std::memory_order_relaxed);
+                    bytes.fetch_add(length, std::memory_order_relaxed);
+                    return std::chrono::steady_clock::now() < end;
+                }, config);
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        double seconds = std::chrono::duration<double>(duration).count();
+        printf("%zu shard(s), %zu devices: %.0f completions/s, %.2f MB/s\n", shards, threads.size(),
+               completions / seconds, bytes / seconds / 1e6);
+
+        devices.clear();    // Devices must be released before the pool
+    }
+
+    return 0;
+}
@@ -90,6 +90,16 @@ int main() {
         if (device) {
             printf("Device state: %s\n", usb::state_str(device->info.state));
 
+            // Instead of hard-coding endpoint numbers, you can look them up in the active configuration
+            for (const auto& ep : device->configuration().endpoints) {
+                printf(" -- Interface %d/%d, endpoint 0x%02X, max packet size %d, recommended buffer %zu bytes\n",
+                       ep.interface_number, ep.alt_setting, ep.address, ep.max_packet_size,
+                       device->recommended_buffer_size(ep.address));
+            }
+            // e.g. the first bulk IN endpoint of a CDC data interface (class 0x0A):
+            //  const usb::endpoint_info* ep = device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN, 0x0A);
+            //  std::string data = device->bulk_read(ep->address);    // The buffer size is chosen automatically
+
             // If you are not satisfied with the feature set, you can still use the original libusb api (if included above)
             //libusb_device_handle* handle = device->get_handle();
             //libusb_device* raw_device = libusb_get_device(handle);    // Now use it how you like
@@ -99,5 +109,19 @@ int main() {
         }
     }
 
+    // If you know which device you want, open it directly by the port it is plugged into or by its serial number.
+    // This opens no other device, and reopening it later skips the bus enumeration entirely.
+    {
+        auto devices = usb::scan_devices(context);
+        if (!devices.empty()) {
+            std::string path = devices.front().port_path();     // e.g. "1-4.2"
+            printf("\nOpening device at port %s\n", path.c_str());
+
+            usb::device device = usb::open_device_by_path(path, context);
+            printf("Device %s\n", device ? usb::state_str(device->info.state) : "not found");
+        }
+        //usb::device device = usb::open_device_by_serial("0123456789", vid, pid, context);
+    }
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include <iostream>
+#include <random>
+#include <cstring>
+#include "libusbcpp.h"
+#include "libusbcpp_framing.h"
+
+// Microbenchmarks of the framing layer, no device needed: Frames are encoded into one long byte stream,
+// which is then handed to the receiver in 16 kB pieces, just like bulk reads would.
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void benchmark_primitives() {
+    std::vector<uint8_t> data(64 * 1024 * 1024);
+    std::mt19937 rng(42);
+    for (auto& byte : data) {
+        byte = (uint8_t)(rng() % 64);      // A delimiter every 64 bytes on average, as with small frames
+    }
+    const uint8_t* end = data.data() + data.size();
+
+    auto start = bench_clock::now();
+    size_t count = 0;
+    for (const uint8_t* p = data.data(); (p = usb::find_byte(p, end, 0x00)) != end; p++) {
+        count++;
+    }
+    printf("find_byte:  %6.2f GB/s (%zu delimiters)\n", data.size() / seconds_since(start) / 1e9, count);
+
+    start = bench_clock::now();
+    count = 0;
+    for (const uint8_t* p = data.data(); (p = (const uint8_t*)memchr(p, 0x00, end - p)) != nullptr; p++) {
+        count++;
+    }
+    printf("memchr:     %6.2f GB/s (%zu delimiters)\n", data.size() / seconds_since(start) / 1e9, count);
+
+    start = bench_clock::now();
+    uint16_t c16 = usb::crc16(data.data(), data.size());
+    printf("crc16:      %6.2f GB/s (0x%04X)\n", data.size() / seconds_since(start) / 1e9, c16);
+
+    start = bench_clock::now();
+    uint32_t c32 = usb::crc32(data.data(), data.size());
+    printf("crc32:      %6.2f GB/s (0x%08X)\n", data.size() / seconds_since(start) / 1e9, c32);
+}
+
+static void benchmark_codec(const char* name, usb::framing_config config, size_t frame_size) {
+    std::mt19937 rng(42);
+    std::vector<uint8_t> frame(frame_size);
+    std::vector<uint8_t> stream;
+    size_t frame_count = (32 * 1024 * 1024) / frame_size;
+    for (size_t i = 0; i < frame_count; i++) {
+        for (auto& byte : frame) {
+            byte = (uint8_t)rng();      // Random payload contains delimiters, so they get escaped
+        }
+        usb::encode_frame(config, frame.data(), frame.size(), stream);
+    }
+
+    usb::frame_receiver receiver(config);
+    size_t received = 0;
+    size_t position = 0;
+    auto start = bench_clock::now();
+    while (position < stream.size()) {
+        size_t size;
+        uint8_t* buffer = receiver.prepare(size);
+        size = std::min({ size, stream.size() - position, (size_t)16384 });
+        memcpy(buffer, stream.data() + position, size);     // Stands in for bulk_read()
+        receiver.commit(size);
+        position += size;
+
+        while (auto view = receiver.next()) {
+            received += view->length == frame_size;
+        }
+    }
+    double seconds = seconds_since(start);
+
+    printf("%-24s %5zu bytes: %7.2f M frames/s, %7.1f MB/s%s\n", name, frame_size, received / seconds / 1e6,
+           stream.size() / seconds / 1e6, received == frame_count ? "" : " (frames lost!)");
+}
+
+// How it looks with a real device: Read straight into the receive buffer and handle the frames in place
+void receive_from_device() {
+    usb::context context;
+    usb::device device = usb::find_first_device(0x1209, 0x0D32, context);
+    if (!device)
+        return;
+
+    const usb::endpoint_info* ep = device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN);
+    if (!ep || !device->claim_interface(ep->interface_number))
+        return;
+
+    usb::framing_config config;
+    config.codec = usb::frame_codec::COBS;
+    config.checksum = usb::frame_checksum::CRC16;
+    usb::frame_receiver receiver(config);
+
+    while (receiver.receive(*device, ep->address) > 0) {
+        while (auto frame = receiver.next()) {
+            printf("Frame of %zu bytes\n", frame->length);
+        }
+    }
+}
+
+int main() {
+
+    benchmark_primitives();
+
+    for (size_t frame_size : { 32, 512 }) {
+        for (auto codec : { usb::frame_codec::LENGTH_PREFIXED, usb::frame_codec::COBS, usb::frame_codec::SLIP }) {
+            const char* codec_name = codec == usb::frame_codec::COBS ? "COBS"
+                                   : codec == usb::frame_codec::SLIP ? "SLIP" : "Length-prefixed";
+            usb::framing_config config;
+            config.codec = codec;
+            benchmark_codec(codec_name, config, frame_size);
+
+            config.checksum = usb::frame_checksum::CRC32;
+            benchmark_codec((std::string(codec_name) + " + CRC32").c_str(), config, frame_size);
+        }
+    }
+
+    //receive_from_device();
+
+    return 0;
+}
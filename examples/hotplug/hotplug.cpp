@@ -19,7 +19,7 @@ void synchronous_hotplug_handler_all() {
 
     // In this example the device is simply added to an array of devices. This is synchronous, the callback is called
     // from the thread calling hotplug.update().
-    // Only one callback can be registered at a time, registering overwrites any previous callback
+    // Any number of callbacks can be registered, each one returns an id for hotplug.unregister_callback(id)
 
     // You can also register a simple c-style function pointer:
     //  hotplug.register_device_callback(callback_function);
@@ -59,6 +59,13 @@ void synchronous_hotplug_handler_all() {
     // In the meantime we can use our device from another thread
     // (make sure to properly mutex your vector thread-safely)
 
+    // Callbacks can also be filtered by device or interface class, and removal callbacks tell you when a device is gone
+    usb::hotplug_filter filter;
+    filter.interface_class = 0x03;      // HID
+    hotplug.register_removal_callback(filter, [] (const usb::device_info& info) {
+        printf("HID device removed: 0x%04X/0x%04X\n", info.vendor_id, info.product_id);
+    });
+
     while (true) {
         hotplug.update();   // Simply call this in your main loop, it will only scan in the interval you specify above
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
@@ -115,6 +122,8 @@ void async_hotplug_handler_specific() {
         // In this example we start the loop in a background thread. The only difference is that you do not need
         // to care about calling hotplug.update(), it is done automatically. However, be careful as the callback is now
         // called from another thread. Think about this when mutex-locking your device objects.
+        // Callbacks run on their own worker thread, so a slow callback does not delay the detection of other devices.
+        // Use hotplug.set_executor() to run them somewhere else, e.g. on your own thread pool.
 
         if (device->is_open()) {
             printf("New device connected: 0x%04X/0x%04X (state %s) -> %s\n",
@@ -128,11 +137,25 @@ void async_hotplug_handler_specific() {
         }
     });
 
+    // Every thread the library starts can be named, pinned to CPUs and given a real-time priority.
+    // This can also be set on the context, e.g. usb::context context(threads). SCHED_FIFO usually needs root.
+    usb::thread_config threads;
+    threads.cpus = { 0 };
+    threads.policy = usb::thread_policy::FIFO;
+    threads.priority = 50;
+    hotplug.set_thread_config(threads);
+
     hotplug.run_async();    // Here we start the background thread. It runs until you call .stop_async(),
-                            // or until the hotplug object runs out of scope and is destroyed
+                            // or until the hotplug object runs out of scope and is destroyed.
+                            // It sleeps until the next scan is due, hotplug.rescan_now() wakes it up immediately
 
     while (true) {  // Do nothing
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::seconds(10));
+
+        // How late the scans happen compared to their schedule, shows whether the priority helps
+        usb::wakeup_jitter jitter = hotplug.jitter();
+        printf("%llu scans, lateness mean %lld us, max %lld us\n", (unsigned long long)jitter.wakeups,
+               (long long)jitter.mean().count(), (long long)jitter.max.count());
 
         //std::unique_lock<std::mutex> lock(mutex);
         //devices.something...
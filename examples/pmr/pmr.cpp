@@ -0,0 +1,52 @@
+
+#include <iostream>
+#include <array>
+#include "libusbcpp.h"
+
+// This example shows how to keep libusbcpp off the global heap after startup. Scans, device objects and reads
+// all take their memory from a caller-supplied memory resource. tests/pmr.cpp checks that this really holds.
+// Note that libusb itself allocates internally with malloc.
+
+// Create a libusbcpp context. This has to outlive any device objects.
+// Make sure that all devices are destroyed when the main function returns.
+// (Basically just means no usb::device's at the global scope)
+usb::context context;
+
+int main() {
+
+    // All memory comes from this static arena, the pool recycles what is freed
+    static std::array<std::byte, 4 * 1024 * 1024> arena;
+    std::pmr::monotonic_buffer_resource upstream(arena.data(), arena.size(), std::pmr::null_memory_resource());
+    std::pmr::unsynchronized_pool_resource pool(&upstream);
+
+    // You will have to choose something that fits your device for testing.
+    int vid = 0x1209;
+    int pid = 0x0D32;
+
+    // Startup: Open the device and prepare all buffers. The device object, its description and its parsed
+    // configuration are allocated from the pool as well.
+    std::pmr::vector<usb::pmr::device_info> devices(&pool);
+    size_t count = usb::pmr::scan_devices(devices, context);
+
+    auto found = usb::pmr::find_devices(vid, pid, &pool, context);
+    usb::device device = found.empty() ? nullptr : found.front();
+    const usb::endpoint_info* ep = device ? device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN) : nullptr;
+    std::array<uint8_t, 4096> buffer {};
+
+    // Steady state: Repeated scans reuse the entries, only the first 'count' of them are valid
+    size_t received = 0;
+    for (int i = 0; i < 100; i++) {
+        count = usb::pmr::scan_devices(devices, context);
+        if (ep) {
+            received += device->bulk_read_into(ep->address, buffer.data(), buffer.size(), 10);
+            std::pmr::string data = device->bulk_read_pmr(ep->address, &pool, LIBUSBCPP_AUTO_BUFFER_SIZE, 10);
+            received += data.size();
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        printf("0x%04X/0x%04X -> %s\n", devices[i].vendor_id, devices[i].product_id, devices[i].description.c_str());
+    }
+    printf("%zu bytes received\n", received);
+    return 0;
+}
@@ -0,0 +1,58 @@
+
+#include <iostream>
+#include "libusbcpp_recorder.h"
+
+// Create a libusbcpp context. This has to outlive any device objects.
+// Make sure that all devices are destroyed when the main function returns.
+// (Basically just means no usb::device's at the global scope)
+usb::context context;
+
+int main(int argc, char** argv) {
+
+    //usb::enable_logging(true/false);
+
+    const char* path = argc > 1 ? argv[1] : "recording.bin";
+
+    // You will have to choose something that fits your device for testing.
+    int vid = 0x1209;
+    int pid = 0x0D32;
+
+    usb::device device = usb::find_first_device(vid, pid, context);
+    if (!device) {
+        printf("No device found :(\n");
+        return 0;
+    }
+
+    const usb::endpoint_info* ep = device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN);
+    if (!ep || !device->claim_interface(ep->interface_number)) {
+        printf("Device has no usable bulk IN endpoint\n");
+        return 0;
+    }
+
+    // The recorder streams the endpoint into the file on its own threads. Every transfer gets a header with
+    // a sequence number and a timestamp, so the file can be split into transfers again and gaps can be found.
+    usb::recorder_config config;
+    config.block_size = 8 * 1024 * 1024;
+    config.block_count = 32;        // 256 MB to absorb disk stalls
+
+    usb::recorder recorder(device, ep->address, path, config);
+    if (!recorder.start()) {
+        printf("Cannot start recording to %s\n", path);
+        return 0;
+    }
+
+    for (int i = 0; i < 10; i++) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        usb::recorder_stats stats = recorder.stats();
+        printf("received %.1f MB, written %.1f MB, dropped %llu chunks, backpressure %llu, max queue %zu blocks\n",
+               stats.bytes_received / 1e6, stats.bytes_written / 1e6, (unsigned long long)stats.chunks_dropped,
+               (unsigned long long)stats.backpressure_events, stats.max_queued_blocks);
+    }
+    recorder.stop();
+
+    usb::recorder_stats stats = recorder.stats();
+    printf("Recorded %llu chunks into %s, %.1f s spent writing\n",
+           (unsigned long long)stats.chunks_recorded, path, stats.write_seconds);
+
+    return 0;
+}
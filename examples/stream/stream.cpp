@@ -0,0 +1,59 @@
+
+#include <iostream>
+#include "libusbcpp.h"
+
+// Create a libusbcpp context. This has to outlive any device objects.
+// Make sure that all devices are destroyed when the main function returns.
+// (Basically just means no usb::device's at the global scope)
+usb::context context;
+
+int main() {
+
+    //usb::enable_logging(true/false);
+
+    // You will have to choose something that fits your device for testing.
+    int vid = 0x1209;
+    int pid = 0x0D32;
+
+    usb::device device = usb::find_first_device(vid, pid, context);
+    if (!device) {
+        printf("No device found :(\n");
+        return 0;
+    }
+
+    // Look for the first bulk IN endpoint instead of hard-coding it
+    const usb::endpoint_info* ep = device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN);
+    if (!ep || !device->claim_interface(ep->interface_number)) {
+        printf("Device has no usable bulk IN endpoint\n");
+        return 0;
+    }
+
+    // The auto-tuner measures throughput and completion latency while streaming and adjusts the transfer size
+    // and the number of transfers in flight, within the limits you set here
+    usb::stream_config config;
+    config.max_memory = 8 * 1024 * 1024;
+    config.max_latency = std::chrono::milliseconds(10);
+
+    device->on_stream_parameters([] (const usb::stream_parameters& params) {
+        printf("%zu bytes x %d transfers: %.2f MB/s, latency %lld us%s\n",
+               params.transfer_size, params.queue_depth, params.throughput / 1e6,
+               (long long)params.latency.count(), params.settled ? " (settled)" : "");
+    });
+
+    // Stream for 10 seconds. Returning false from the callback ends the stream.
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    size_t total = 0;
+    usb::stream_parameters params = device->stream_read(ep->address, [&] (const uint8_t*, size_t length) {
+        total += length;
+        return std::chrono::steady_clock::now() < end;
+    }, config);
+    printf("Received %zu bytes\n", total);
+
+    // To pin the parameters that were found, feed them back and disable auto-tuning:
+    config.auto_tune = false;
+    config.transfer_size = params.transfer_size;
+    config.queue_depth = params.queue_depth;
+    printf("Pinned: transfer_size = %zu, queue_depth = %d\n", config.transfer_size, config.queue_depth);
+
+    return 0;
+}
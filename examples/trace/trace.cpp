@@ -0,0 +1,54 @@
+#include <iostream>
+#include "libusbcpp.h"
+#include "libusbcpp_trace.h"
+
+// Records a timeline of a device scan and a few seconds of streaming. Build libusbcpp with -DLIBUSBCPP_TRACING=on,
+// otherwise the trace stays empty. Open trace.json in chrome://tracing or https://ui.perfetto.dev
+
+usb::context context;
+
+static void measure_span_cost(const char* label) {
+    const int count = 10000000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        usb::trace::span span("measure", "example");
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%s: %.1f ns per span\n", label, ns / count);
+}
+
+int main() {
+
+    //usb::enable_logging(true/false);
+
+    // What a span costs while tracing is not running
+    measure_span_cost("Inactive");
+
+    usb::trace::start();
+
+    // Your own code can add spans to the same timeline
+    {
+        usb::trace::span span("scan", "example");
+        std::vector<usb::device_info> devices = usb::scan_devices(context);
+        printf("Found %zu devices\n", devices.size());
+    }
+
+    // You will have to choose something that fits your device for testing.
+    usb::device device = usb::find_first_device(0x1209, 0x0D32, context);
+    const usb::endpoint_info* ep = device ? device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN) : nullptr;
+    if (ep && device->claim_interface(ep->interface_number)) {
+
+        // Every transfer shows up with its submission, its time in flight, its completion and your callback
+        auto end = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        device->stream_read(ep->address, [&] (const uint8_t*, size_t) {
+            return std::chrono::steady_clock::now() < end;
+        });
+    }
+
+    usb::trace::stop();
+    if (usb::trace::save("trace.json")) {
+        printf("Saved trace.json (%llu events dropped)\n", (unsigned long long)usb::trace::dropped());
+    }
+
+    return 0;
+}
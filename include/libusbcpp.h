@@ -11,8 +11,14 @@
 #include <functional>
 #include <cinttypes>
 #include <atomic>
+#include <bitset>
+#include <array>
+#include <unordered_map>
+#include <condition_variable>
+#include <memory_resource>
 
 #define LIBUSBCPP_DEFAULT_BUFFER_SIZE (1024 * 8)        // [bytes] Default 8 kB buffer
+#define LIBUSBCPP_AUTO_BUFFER_SIZE ((size_t)0)          // Choose the buffer size from the endpoint descriptor
 #define LIBUSBCPP_DEFAULT_TIMEOUT 1000                  // [ms]
 #define LIBUSBCPP_DEFAULT_HOTPLUG_RESCAN_INTERVAL 1000  // [ms]
 
@@ -42,12 +48,46 @@ namespace usb {
     LIBUSBCPP_API const char* state_str(enum state state);
     LIBUSBCPP_API void enable_logging(bool enable = true);
 
+    enum class thread_policy {
+        DEFAULT,        // Normal time-sharing scheduling (SCHED_OTHER), also when the thread was real-time before
+        FIFO,           // SCHED_FIFO
+        ROUND_ROBIN     // SCHED_RR
+    };
+
+    // Scheduling of the threads the library starts. Real-time policies usually need privileges (e.g. CAP_SYS_NICE),
+    // if a setting cannot be applied it is logged and the thread keeps running with the defaults.
+    struct LIBUSBCPP_API thread_config {
+        std::string name;                           // Prefix of the thread names, empty = "usb", e.g. "usb-hotplug"
+        std::vector<int> cpus;                      // CPUs the thread may run on, empty = any
+        thread_policy policy = thread_policy::DEFAULT;
+        int priority = 0;                           // 1 to 99 for the real-time policies
+    };
+
+    // Applies the config to a running thread, which is named "<name>-<role>". Returns false if anything failed,
+    // e.g. a CPU index beyond what the platform supports: The affinity is left unchanged then.
+    LIBUSBCPP_API bool configure_thread(std::thread& thread, const thread_config& config, const std::string& role);
+
+    // Same for the calling thread. Threads started by the library call this first, before entering their loop.
+    LIBUSBCPP_API bool configure_this_thread(const thread_config& config, const std::string& role);
+
+    // How late scheduled wake-ups happen, i.e. the time between the deadline and the thread actually running
+    struct LIBUSBCPP_API wakeup_jitter {
+        uint64_t wakeups = 0;
+        std::chrono::microseconds total { 0 };
+        std::chrono::microseconds max { 0 };
+
+        void add(std::chrono::steady_clock::duration lateness);
+        std::chrono::microseconds mean() const;
+    };
+
     class LIBUSBCPP_API context {
     public:
         context();
+        explicit context(const thread_config& threads);     // Default for the threads started for this context
         ~context();
 
         operator libusb_context*() const;
+        const thread_config& threads() const;
 
         context(context const&) = delete;           // Copying prohibited
         void operator=(context const&) = delete;
@@ -57,34 +97,218 @@ namespace usb {
 
     private:
         libusb_context* _context = nullptr;
+        thread_config _threads;
     };
 
-    struct LIBUSBCPP_API device_info {
+    // Everything known about a device except its description
+    struct LIBUSBCPP_API device_properties {
         uint16_t vendor_id = 0x00;
         uint16_t product_id = 0x00;
-        std::string description;
         enum state state = usb::state::CLOSED;
 
+        uint8_t device_class = 0x00;
+        std::bitset<256> interface_classes;     // Classes of all interfaces in the active configuration
+        uint8_t bus_number = 0;
+        uint8_t device_address = 0;
+        std::array<uint8_t, 7> port_numbers {};     // Path of hub ports from the root hub to the device
+        uint8_t port_depth = 0;
+
+        // Stable as long as the device stays plugged into the same port, e.g. "1-4.2" (bus 1, port 4, port 2)
+        std::string port_path() const;
+
+        // Compares the physical device (bus and address) instead of the usb id
+        bool is_same_device(const device_properties& other) const {
+            return bus_number == other.bus_number && device_address == other.device_address;
+        }
+    };
+
+    struct LIBUSBCPP_API device_info : device_properties {
+        std::string description;
+
         bool operator==(const device_info& other) {
             return vendor_id == other.vendor_id && product_id == other.product_id;
         }
     };
 
+    namespace pmr {
+
+        // Same as usb::device_info, but the description is allocated from the memory resource of its container
+        struct LIBUSBCPP_API device_info : device_properties {
+            using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+            std::pmr::string description;
+
+            device_info() = default;
+            explicit device_info(const allocator_type& alloc) : description(alloc) {}
+            device_info(const device_info& other, const allocator_type& alloc)
+                : device_properties(other), description(other.description, alloc) {}
+            device_info(device_info&& other, const allocator_type& alloc)
+                : device_properties(other), description(std::move(other.description), alloc) {}
+
+            device_info(const usb::device_info& other, const allocator_type& alloc = {})
+                : device_properties(other), description(other.description, alloc) {}
+
+            device_info(const device_info&) = default;
+            device_info(device_info&&) = default;
+            device_info& operator=(const device_info&) = default;   // Reuses the capacity of the description
+            device_info& operator=(device_info&&) = default;
+
+            // Like usb::device_info: Compares the usb id only
+            bool operator==(const device_info& other) const {
+                return vendor_id == other.vendor_id && product_id == other.product_id;
+            }
+            bool operator==(const usb::device_info& other) const {
+                return vendor_id == other.vendor_id && product_id == other.product_id;
+            }
+
+            // A copy on the global heap, e.g. to keep it after the device is gone
+            operator usb::device_info() const {
+                usb::device_info info;
+                static_cast<device_properties&>(info) = *this;
+                info.description.assign(description.data(), description.size());
+                return info;
+            }
+        };
+
+    }
+
+    enum class speed {
+        UNKNOWN,
+        LOW,
+        FULL,
+        HIGH,
+        SUPER,
+        SUPER_PLUS
+    };
+
+    enum class transfer_type {
+        CONTROL,
+        ISOCHRONOUS,
+        BULK,
+        INTERRUPT
+    };
+
+    enum class direction {
+        OUT,
+        IN
+    };
+
+    struct LIBUSBCPP_API endpoint_info {
+        uint8_t address = 0x00;             // Including the direction bit
+        uint8_t interface_number = 0;
+        uint8_t alt_setting = 0;
+        enum transfer_type transfer_type = transfer_type::BULK;
+        enum direction direction = direction::OUT;
+        uint16_t max_packet_size = 0;       // [bytes] Without the high-bandwidth multiplier
+        uint8_t max_burst = 0;              // SuperSpeed: Additional packets per burst (0-15)
+        uint8_t mult = 0;                   // Additional transactions per (micro)frame
+        uint16_t bytes_per_interval = 0;    // SuperSpeed periodic endpoints only
+        uint8_t interval = 0;
+
+        // [bytes] What the endpoint can move in one service opportunity
+        size_t burst_size() const {
+            return (size_t)max_packet_size * (max_burst + 1) * (mult + 1);
+        }
+    };
+
+    struct LIBUSBCPP_API interface_info {
+        uint8_t number = 0;
+        uint8_t alt_setting = 0;
+        uint8_t interface_class = 0x00;
+        uint8_t subclass = 0x00;
+        uint8_t protocol = 0x00;
+        uint16_t first_endpoint = 0;        // Index range into configuration_info::endpoints
+        uint8_t num_endpoints = 0;
+    };
+
+    // Flat description of the active configuration: All endpoints of all alt settings live in one array
+    struct LIBUSBCPP_API configuration_info {
+        uint8_t value = 0;
+        enum speed speed = speed::UNKNOWN;
+        std::pmr::vector<interface_info> interfaces;
+        std::pmr::vector<endpoint_info> endpoints;
+    };
+
+    struct LIBUSBCPP_API stream_config {
+        size_t transfer_size = LIBUSBCPP_AUTO_BUFFER_SIZE;      // [bytes] Starting point when auto-tuning
+        int queue_depth = 0;                                    // Transfers in flight, 0 = auto
+        bool auto_tune = true;                                  // Otherwise the values above are pinned
+        size_t max_memory = 16 * 1024 * 1024;                   // [bytes] Limit for transfer_size * queue_depth
+        std::chrono::microseconds max_latency { 20000 };        // Limit for the completion latency of a transfer
+        uint32_t timeout = LIBUSBCPP_DEFAULT_TIMEOUT;           // [ms] Per transfer. Read timeouts are resubmitted,
+                                                                // a write timeout ends the stream
+        std::pmr::memory_resource* resource = nullptr;          // For transfer buffers, nullptr = default resource
+        bool handle_events = true;                              // false = Another thread handles the libusb events,
+                                                                // e.g. the event thread of a context_pool shard.
+                                                                // The stream still blocks its calling thread, which
+                                                                // runs the callback: One thread per stream.
+    };
+
+    struct LIBUSBCPP_API stream_parameters {
+        size_t transfer_size = 0;
+        int queue_depth = 0;
+        double throughput = 0;                                  // [bytes/s] Measured in the last window with
+                                                                // exactly these parameters, 0 if not measured yet
+        std::chrono::microseconds latency { 0 };                // Average from submission to completion
+        bool settled = false;                                   // Auto-tuning has finished
+    };
+
 	class LIBUSBCPP_API basic_device {
 	public:
-		explicit basic_device(libusb_device_handle* handle, usb::device_info  info);
+		explicit basic_device(libusb_device_handle* handle, const usb::device_info& info,
+                              libusb_context* context = nullptr, std::pmr::memory_resource* resource = nullptr);
+		explicit basic_device(libusb_device_handle* handle, const pmr::device_info& info,
+                              libusb_context* context = nullptr, std::pmr::memory_resource* resource = nullptr);
 		~basic_device();
 
-        device_info info;
+        // The description lives in the memory resource of the device, so it is a std::pmr::string: Copy it with
+        // std::string(info.description.begin(), info.description.end()), or the whole info into a usb::device_info.
+        pmr::device_info info;
 
 		bool claim_interface(int _interface);
         bool is_open();
         libusb_device_handle* get_handle();
 
+        // The active configuration is parsed once on first use and cached. If it cannot be read, an empty one
+        // is returned and the next call tries again.
+        const configuration_info& configuration();
+        const interface_info* find_interface(uint8_t interface_class);
+        const endpoint_info* find_endpoint(uint8_t address);
+        const endpoint_info* find_endpoint(enum transfer_type type, enum direction direction,
+                                           std::optional<uint8_t> interface_class = std::nullopt);
+
+        // A multiple of the endpoint's burst size, falls back to LIBUSBCPP_DEFAULT_BUFFER_SIZE for unknown endpoints
+        size_t recommended_buffer_size(uint8_t address);
+
         std::string bulk_read(uint16_t endpoint,
-                              size_t max_buffer_size = LIBUSBCPP_DEFAULT_BUFFER_SIZE,
+                              size_t max_buffer_size = LIBUSBCPP_AUTO_BUFFER_SIZE,
+                              uint32_t timeout = LIBUSBCPP_DEFAULT_TIMEOUT);
+        std::pmr::string bulk_read_pmr(uint16_t endpoint, std::pmr::memory_resource* resource,
+                                       size_t max_buffer_size = LIBUSBCPP_AUTO_BUFFER_SIZE,
+                                       uint32_t timeout = LIBUSBCPP_DEFAULT_TIMEOUT);
+
+        // Reads into your own buffer, does not allocate. Returns 0 on error.
+        size_t bulk_read_into(uint16_t endpoint, uint8_t* buffer, size_t length,
                               uint32_t timeout = LIBUSBCPP_DEFAULT_TIMEOUT);
 
+        // Keeps multiple asynchronous transfers in flight until the callback returns false or an error occurs.
+        // libusb events are handled on the calling thread. Returns the parameters in use when the stream ended,
+        // they can be fed back as a pinned stream_config. When a transfer times out without data, the callback
+        // is called with length 0, so it can end an idle stream.
+        stream_parameters stream_read(uint8_t endpoint,
+                                      const std::function<bool(const uint8_t* data, size_t length)>& callback,
+                                      const stream_config& config = {});
+
+        // The callback fills the buffer and returns the number of bytes to send. Returning 0 ends the stream once
+        // the transfers already queued are sent, a short write counts as an error.
+        stream_parameters stream_write(uint8_t endpoint,
+                                       const std::function<size_t(uint8_t* buffer, size_t capacity)>& callback,
+                                       const stream_config& config = {});
+
+        // Called from the streaming thread after every measurement window of the auto-tuner, with the parameters
+        // that were measured in it. Timed out reads are not measured, they restart the window.
+        void on_stream_parameters(const std::function<void(const stream_parameters&)>& callback);
+
         // These return 0 on error
 		size_t bulk_write(std::vector<uint8_t> data, uint16_t endpoint, uint32_t timeout = LIBUSBCPP_DEFAULT_TIMEOUT);
 		size_t bulk_write(const std::string& data, uint16_t endpoint, uint32_t timeout = LIBUSBCPP_DEFAULT_TIMEOUT);
@@ -96,13 +320,20 @@ namespace usb {
 	private:
 
         size_t bulk_transfer(uint16_t endpoint, unsigned char* buffer, size_t max_buffer_size, uint32_t timeout);
+        stream_parameters stream(uint8_t endpoint, const stream_config& config,
+                                 const std::function<bool(const uint8_t*, size_t)>& read_callback,
+                                 const std::function<size_t(uint8_t*, size_t)>& write_callback);
 
 		void close();
 		void lost_connection();
         bool detach_kernel_driver(int _interface);
 
 		libusb_device_handle* handle = nullptr;
-        std::vector<int> interfaces;
+        libusb_context* context = nullptr;
+        std::pmr::memory_resource* resource = nullptr;
+        std::pmr::vector<int> interfaces;
+        std::optional<configuration_info> config;
+        std::function<void(const stream_parameters&)> stream_parameters_callback;
 
 		std::mutex mutex;   // Lock for all callable functions
 	};
@@ -115,6 +346,49 @@ namespace usb {
     typedef std::shared_ptr<basic_device> device;
     typedef std::chrono::time_point<std::chrono::high_resolution_clock> timepoint;
 
+    // An executor runs a task somewhere, for example inline or on a worker thread
+    using executor = std::function<void(std::function<void()>)>;
+    using hotplug_callback_id = size_t;
+
+    LIBUSBCPP_API executor inline_executor();
+
+    // Runs all posted tasks one after another on a single background thread.
+    // Pending tasks are discarded on destruction, the currently running one is finished.
+    class LIBUSBCPP_API worker_executor {
+    public:
+        worker_executor();
+        explicit worker_executor(const thread_config& config, const std::string& role = "worker");
+        ~worker_executor();
+
+        void post(std::function<void()> task);
+        operator executor();
+
+        void configure(const thread_config& config, const std::string& role = "worker");  // Of the running thread
+
+        worker_executor(worker_executor const&) = delete;
+        worker_executor& operator=(worker_executor const&) = delete;
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::queue<std::function<void()>> tasks;
+        bool terminate = false;
+        std::thread thread;
+
+        void start(std::optional<thread_config> config, std::string role);
+    };
+
+    // Every field that is set must match, empty fields match anything
+    struct LIBUSBCPP_API hotplug_filter {
+        std::optional<uint16_t> vendor_id;
+        std::optional<uint16_t> product_id;
+        std::optional<uint8_t> device_class;
+        std::optional<uint8_t> interface_class;    // Hotplug scans only read interface classes if a filter sets this
+        bool notify_known_devices = false;      // Fire on every scan for every available device, not only new ones
+
+        bool matches(const device_properties& info) const;
+    };
+
 
 
 
@@ -125,20 +399,51 @@ namespace usb {
 
         explicit generic_hotplug_handler(opt_context context = std::nullopt, int interval = LIBUSBCPP_DEFAULT_HOTPLUG_RESCAN_INTERVAL);
 
-        void register_device_callback(const std::function<void(usb::device)>& callback);
-        void register_device_callback(uint16_t vendor_id, uint16_t product_id, const std::function<void(usb::device)>& callback);
+        // Any number of callbacks can be registered, the returned id can be used to unregister them again
+        hotplug_callback_id register_device_callback(const std::function<void(usb::device)>& callback);
+        hotplug_callback_id register_device_callback(uint16_t vendor_id, uint16_t product_id, const std::function<void(usb::device)>& callback);
+        hotplug_callback_id register_device_callback(const hotplug_filter& filter, const std::function<void(usb::device)>& callback);
+        hotplug_callback_id register_removal_callback(const hotplug_filter& filter, const std::function<void(const device_info&)>& callback);
+        // Callbacks still queued on the executor are skipped after this. One that is already running is not
+        // waited for, it may finish after unregister_callback() returned.
+        void unregister_callback(hotplug_callback_id id);
+
+        // Callbacks are dispatched on this executor, by default inline on the thread calling update()
+        void set_executor(executor executor);
 
         void update();
+        void rescan();      // Scan immediately, no matter when the last scan happened
 
     private:
         void update_devices();
 
+        struct registration {
+            hotplug_filter filter;
+            std::function<void(usb::device)> device_callback;
+            std::function<void(const device_info&)> removal_callback;
+            std::shared_ptr<std::atomic<bool>> alive;  // Cleared on unregister, queued callbacks check it
+        };
+
+        // Never modified once published: Registering copies it, so a scan can use it without holding the lock
+        struct registry {
+            std::unordered_map<hotplug_callback_id, registration> registrations;
+            std::unordered_map<uint32_t, std::vector<hotplug_callback_id>> id_index;   // Filters with vid and pid
+            std::vector<hotplug_callback_id> wildcard_index;                            // All other filters
+            bool needs_interface_classes = false;   // Only then the configuration descriptors are read
+        };
+
+        hotplug_callback_id add_registration(registration reg);
+        static void collect_matches(const registry& snapshot, const device_info& info, bool is_new, bool removal,
+                                    std::vector<hotplug_callback_id>& matches);
+
         opt_context context = std::nullopt;
 
-        std::function<void(usb::device)> callback;
-        uint16_t callback_vid = -1;
-        uint16_t callback_pid = -1;
+        std::mutex registry_mutex;
+        std::shared_ptr<const registry> _registry = std::make_shared<registry>();
+        hotplug_callback_id next_id = 1;
+        executor dispatch = inline_executor();
 
+        std::mutex update_mutex;                // Serializes scans, they own old_devices
         std::vector<device_info> old_devices;   // Storing what devices are already known to the system
         timepoint last_update;
     };
@@ -149,27 +454,71 @@ namespace usb {
         explicit hotplug_handler(opt_context context = std::nullopt, int interval = LIBUSBCPP_DEFAULT_HOTPLUG_RESCAN_INTERVAL);
         ~hotplug_handler();
 
-        void register_device_callback(const std::function<void(usb::device)>& callback);
-        void register_device_callback(uint16_t vendor_id, uint16_t product_id, const std::function<void(usb::device)>& callback);
+        hotplug_callback_id register_device_callback(const std::function<void(usb::device)>& callback);
+        hotplug_callback_id register_device_callback(uint16_t vendor_id, uint16_t product_id, const std::function<void(usb::device)>& callback);
+        hotplug_callback_id register_device_callback(const hotplug_filter& filter, const std::function<void(usb::device)>& callback);
+        hotplug_callback_id register_removal_callback(const hotplug_filter& filter, const std::function<void(const device_info&)>& callback);
+        void unregister_callback(hotplug_callback_id id);
+
+        // By default callbacks run on a dedicated worker thread, so slow callbacks do not delay scanning
+        void set_executor(executor executor);
 
         void update();
 
+        // The background thread sleeps until the next scan is due or until it is woken up.
+        // With an interval <= 0 it scans once when started and after that only on rescan_now().
         void run_async();
         void stop_async();
+        void rescan_now();  // Wakes up the background thread, or scans synchronously if it is not running
+
+        // Applies to the background thread and the default callback thread. Taken from the context by default.
+        void set_thread_config(const thread_config& config);
+
+        // Lateness of the periodic scans, only recorded while running with an interval > 0
+        wakeup_jitter jitter();
 
     private:
-        std::atomic<bool> terminate = false;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool terminate = false;
+        bool rescan_requested = false;
         std::thread thread;
         int interval = 0;
+        thread_config threads;
+        wakeup_jitter _jitter;
 
+        worker_executor dispatcher;
         generic_hotplug_handler handler;
     };
 
 
 
     LIBUSBCPP_API std::vector<device_info> scan_devices(opt_context context = std::nullopt);
+    LIBUSBCPP_API std::vector<device_properties> list_devices(opt_context context = std::nullopt);  // Opens nothing
     LIBUSBCPP_API std::vector<usb::device> find_devices(uint16_t vendor_id, uint16_t product_id, opt_context context = std::nullopt);
     LIBUSBCPP_API std::vector<usb::device> find_valid_devices(uint16_t vendor_id, uint16_t product_id, opt_context context = std::nullopt);
     LIBUSBCPP_API usb::device find_first_device(uint16_t vendor_id, uint16_t product_id, opt_context context = std::nullopt);
 
+    // Open exactly one device without opening any other one. Once found, a device is cached and reopening it
+    // costs a single libusb_open, until it is unplugged or clear_device_cache() is called.
+    LIBUSBCPP_API usb::device open_device_by_path(const std::string& port_path, opt_context context = std::nullopt);
+    LIBUSBCPP_API usb::device open_device_by_serial(const std::string& serial, opt_context context = std::nullopt);
+    LIBUSBCPP_API usb::device open_device_by_serial(const std::string& serial, uint16_t vendor_id, uint16_t product_id,
+                                                    opt_context context = std::nullopt);  // Only opens matching ids
+    LIBUSBCPP_API void clear_device_cache(opt_context context = std::nullopt);
+
+    // Allocator-aware variants: Results, device objects and descriptions come from the given memory resource
+    namespace pmr {
+        LIBUSBCPP_API std::pmr::vector<device_info> scan_devices(std::pmr::memory_resource* resource,
+                                                                 opt_context context = std::nullopt);
+
+        // Overwrites the entries in place and reuses their capacity, repeated scans do not allocate. Returns the
+        // number of devices found: Entries after that are left over from earlier scans and only kept for their capacity.
+        LIBUSBCPP_API size_t scan_devices(std::pmr::vector<device_info>& devices, opt_context context = std::nullopt);
+
+        LIBUSBCPP_API std::pmr::vector<usb::device> find_devices(uint16_t vendor_id, uint16_t product_id,
+                                                                 std::pmr::memory_resource* resource,
+                                                                 opt_context context = std::nullopt);
+    }
+
 }
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "libusbcpp.h"
+
+namespace usb {
+
+    struct LIBUSBCPP_API broker_config {
+        uint32_t slot_count = 1024;                         // IN ring: Messages kept for the clients (power of two)
+        uint32_t slot_size = LIBUSBCPP_DEFAULT_BUFFER_SIZE; // [bytes] Larger messages are split into fragments
+        uint32_t out_slot_count = 256;                      // OUT queue: Pending requests (power of two)
+        uint32_t out_slot_size = 4096;                      // [bytes] Largest OUT request
+        std::chrono::milliseconds out_claim_timeout { 1000 };   // A client that claimed an OUT slot but did not
+                                                                // fill it in time is assumed dead, see send()
+
+        uint8_t in_endpoint = 0x00;                         // 0 = Do not read from the device
+        uint8_t out_endpoint = 0x00;                        // 0 = Do not forward OUT requests to the device
+        stream_config stream;                               // For reading the IN endpoint
+        thread_config threads;                              // For the IN and OUT threads
+    };
+
+    // Messages larger than slot_size arrive as several fragments with consecutive sequence numbers. A gap in the
+    // sequence means a fragment was lost, the whole message should be dropped then.
+    struct LIBUSBCPP_API broker_message {
+        const uint8_t* data = nullptr;      // Points directly into shared memory
+        size_t length = 0;
+        uint64_t sequence = 0;
+        bool continued = false;             // Continues the message of the previous sequence number
+        bool more = false;                  // The message continues with the next sequence number
+    };
+
+    // One process owns the device and publishes everything read from the IN endpoint into a shared-memory ring,
+    // which any number of local broker_clients read without copying. Clients queue OUT requests through a
+    // lock-free shared queue, which the broker forwards to the OUT endpoint.
+    // The broker never waits for slow clients, they lose the messages that were overwritten in the meantime.
+    class LIBUSBCPP_API device_broker {
+    public:
+
+        // Without a device, messages are only published manually and requests are only handled by poll_requests().
+        // Throws if another broker of that name is running. Shared memory left behind by a crashed one is replaced.
+        explicit device_broker(const std::string& name, const broker_config& config = {});
+        device_broker(usb::device device, const std::string& name, const broker_config& config = {});
+        ~device_broker();
+
+        // Starts reading the IN endpoint and forwarding the OUT queue in the background
+        void run_async();
+        void stop_async();
+
+        bool publish(const uint8_t* data, size_t length);
+
+        // Hands every queued OUT request to the handler, returns the number of requests
+        size_t poll_requests(const std::function<void(const uint8_t* data, size_t length)>& handler);
+
+        device_broker(device_broker const&) = delete;
+        device_broker& operator=(device_broker const&) = delete;
+
+    private:
+        usb::device device;
+        broker_config config;
+        std::string name;
+
+        void* memory = nullptr;
+        size_t memory_size = 0;
+        void* mapping = nullptr;      // Platform handle of the shared memory
+
+        uint64_t stalled_position = UINT64_MAX;     // OUT slot that was claimed but not filled yet
+        std::chrono::steady_clock::time_point stalled_since;
+
+        std::atomic<bool> terminate = false;
+        std::thread in_thread;
+        std::thread out_thread;
+    };
+
+    class LIBUSBCPP_API broker_client {
+    public:
+
+        // Attaches to a running broker, throws if there is none or its shared memory is inconsistent.
+        // Only messages published from now on are received.
+        explicit broker_client(const std::string& name);
+        ~broker_client();
+
+        // The next message as a view into shared memory, or nothing if no new message is available.
+        // Call release() when done with it: It returns false if the broker overwrote the message while it was
+        // being read, in that case whatever was read must be discarded.
+        std::optional<broker_message> acquire();
+        bool release();
+
+        // Queues an OUT request for the broker, returns false if the queue is full or the data too large.
+        // A client that dies in the middle of a send blocks the queue until the broker gives up on its slot after
+        // out_claim_timeout. A send that stalls that long fails, but its late copy may still land in the slot.
+        bool send(const uint8_t* data, size_t length);
+        bool send(const std::string& data);
+
+        uint64_t lost() const;      // Messages that were overwritten before this client could read them
+
+        broker_client(broker_client const&) = delete;
+        broker_client& operator=(broker_client const&) = delete;
+
+    private:
+        void* memory = nullptr;
+        size_t memory_size = 0;
+        void* mapping = nullptr;
+
+        uint64_t position = 0;
+        uint64_t acquired_sequence = 0;
+        const void* acquired_slot = nullptr;
+        uint64_t lost_messages = 0;
+    };
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "libusbcpp.h"
+
+namespace usb {
+
+    enum class shard_placement {
+        ROUND_ROBIN,    // Devices are spread evenly over the shards in the order they are first seen
+        BY_HUB          // All devices behind the same hub share a shard, hubs are spread evenly
+    };
+
+    struct LIBUSBCPP_API context_pool_config {
+        size_t shards = 2;                              // Number of libusb contexts, each with its own event thread
+        shard_placement placement = shard_placement::BY_HUB;
+        thread_config threads;                          // Event thread i only gets cpus[i % size], if any are set
+    };
+
+    // Splits devices over several libusb contexts, so that the completions of hundreds of devices are not all
+    // handled by a single event thread. A device always lands on the same shard as long as it stays plugged into
+    // the same port. Streams on devices of the pool should set stream_config::handle_events to false and leave
+    // the event handling to the shard threads. Only the event handling is sharded: Each stream still needs a
+    // thread of its own, which sleeps until its transfers complete and runs the callback. All devices must be
+    // released before the pool is destroyed.
+    class LIBUSBCPP_API context_pool {
+    public:
+        explicit context_pool(const context_pool_config& config = {});
+        ~context_pool();
+
+        size_t size() const;
+        usb::context& shard(size_t index);
+        size_t shard_for(const device_properties& device);
+
+        // Every matching device is opened on the context of its shard
+        std::vector<usb::device> find_devices(uint16_t vendor_id, uint16_t product_id);
+        std::vector<usb::device> find_devices(const std::function<bool(const device_properties&)>& filter);
+
+        uint64_t events_handled(size_t index) const;    // Event loop iterations of one shard
+
+        context_pool(context_pool const&) = delete;
+        context_pool& operator=(context_pool const&) = delete;
+
+    private:
+        struct shard_state {
+            std::unique_ptr<usb::context> context;      // Contexts must not move, devices keep the raw pointer
+            std::thread thread;
+            std::atomic<uint64_t> events = 0;
+        };
+
+        void handle_events(shard_state& shard);
+
+        context_pool_config config;
+        std::vector<std::unique_ptr<shard_state>> shards;
+        std::atomic<bool> terminate = false;
+
+        std::mutex placement_mutex;
+        std::unordered_map<std::string, size_t> placements;    // Port path or hub path -> shard
+        size_t next_shard = 0;
+    };
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "libusbcpp.h"
+
+namespace usb {
+
+    enum class frame_codec {
+        LENGTH_PREFIXED,    // Little endian length field followed by the frame
+        COBS,               // Consistent overhead byte stuffing, frames end with 0x00
+        SLIP                // RFC 1055, frames end with 0xC0
+    };
+
+    enum class frame_checksum {
+        NONE,
+        CRC16,              // CRC-16/CCITT-FALSE: Polynomial 0x1021, initial value 0xFFFF
+        CRC32               // CRC-32 as used by zlib and Ethernet
+    };
+
+    struct LIBUSBCPP_API framing_config {
+        frame_codec codec = frame_codec::COBS;
+        frame_checksum checksum = frame_checksum::NONE;     // Little endian at the end of every frame
+        size_t length_bytes = 2;                            // Size of the length field: 1, 2 or 4 bytes
+        size_t max_frame_size = 4096;                       // [bytes] Encoded, longer frames are dropped
+        size_t buffer_size = 64 * 1024;                     // [bytes] Receive buffer, at least 2 * max_frame_size
+    };
+
+    // Payload of a frame without the checksum, pointing directly into the receive buffer
+    struct LIBUSBCPP_API frame_view {
+        const uint8_t* data = nullptr;
+        size_t length = 0;
+    };
+
+    struct LIBUSBCPP_API framing_stats {
+        uint64_t frames = 0;
+        uint64_t checksum_errors = 0;
+        uint64_t decode_errors = 0;         // Malformed COBS or SLIP data
+        uint64_t oversized = 0;             // Frames longer than max_frame_size
+    };
+
+    // Both can be continued: Pass the result of the previous call to checksum data arriving in pieces
+    LIBUSBCPP_API uint16_t crc16(const uint8_t* data, size_t length, uint16_t crc = 0xFFFF);
+    LIBUSBCPP_API uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc = 0);
+
+    // Like memchr, inlined with SSE2 or NEON for short distances. Returns end if the value is not found.
+    LIBUSBCPP_API const uint8_t* find_byte(const uint8_t* begin, const uint8_t* end, uint8_t value);
+
+    // Appends the encoded frame including checksum and delimiter, returns the number of bytes appended
+    LIBUSBCPP_API size_t encode_frame(const framing_config& config, const uint8_t* data, size_t length,
+                                      std::vector<uint8_t>& out);
+
+    // Reassembles frames from the received bytes. Data is read straight into the buffer with prepare() and
+    // commit(), COBS and SLIP frames are decoded in place and handed out as views without copying.
+    //
+    //     size_t size;
+    //     uint8_t* buffer = receiver.prepare(size);
+    //     receiver.commit(device->bulk_read_into(endpoint, buffer, size));
+    //     while (auto frame = receiver.next()) { ... }
+    //
+    // Views stay valid until the next call to prepare(), receive() or feed(). Take all frames with next() before
+    // preparing more space, a buffer that fills up without a complete frame counts as an oversized frame.
+    class LIBUSBCPP_API frame_receiver {
+    public:
+        explicit frame_receiver(const framing_config& config = {});
+
+        uint8_t* prepare(size_t& size);     // Free space at the end of the buffer, size is set to its length
+        void commit(size_t length);         // Number of bytes that were written into the prepared space
+
+        std::optional<frame_view> next();   // The next complete frame, if there is one
+
+        // Convenience for the two common sources: One bulk read, or data from a stream callback. That data is
+        // copied once, the handler gets every frame completed by it, so any amount of data can be fed at once.
+        // receive() reads whole packets of the IN endpoint only and returns the number of bytes added to the buffer,
+        // 0 if the device has no such endpoint.
+        size_t receive(basic_device& device, uint8_t endpoint, uint32_t timeout = LIBUSBCPP_DEFAULT_TIMEOUT);
+        void feed(const uint8_t* data, size_t length, const std::function<void(const frame_view&)>& handler);
+
+        void reset();       // Drops everything received so far
+        const framing_stats& stats() const;
+
+    private:
+        std::optional<frame_view> next_delimited(uint8_t delimiter);
+        std::optional<frame_view> next_length_prefixed();
+        std::optional<frame_view> check(uint8_t* frame, size_t length);
+
+        framing_config config;
+        std::vector<uint8_t> buffer;
+        size_t begin = 0;           // Start of the first unprocessed frame
+        size_t end = 0;             // End of the received data
+        size_t scanned = 0;         // Searched for a delimiter up to here, so no byte is searched twice
+        bool skipping = false;      // Dropping the rest of an oversized frame up to the next delimiter
+
+        uint32_t crc = 0;           // Length-prefixed: Checksum of the current frame up to crc_position
+        size_t crc_position = 0;
+
+        std::vector<uint8_t> spill; // receive(): Packet read while less than a packet was free
+        size_t spill_begin = 0;     // Bytes of it not yet copied into the buffer
+        size_t spill_end = 0;
+
+        framing_stats _stats;
+    };
+
+}
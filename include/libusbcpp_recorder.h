@@ -0,0 +1,97 @@
+#pragma once
+
+#include "libusbcpp.h"
+
+#define LIBUSBCPP_RECORDER_MAGIC 0x43524255     // Start of every recorder_chunk_header
+#define LIBUSBCPP_RECORDER_ALIGNMENT 4096       // [bytes] Alignment of blocks for direct I/O
+
+namespace usb {
+
+    struct LIBUSBCPP_API recorder_config {
+        size_t block_size = 4 * 1024 * 1024;    // [bytes] One disk write, multiple of LIBUSBCPP_RECORDER_ALIGNMENT
+        size_t block_count = 16;                // Blocks between USB and disk, this is how long a disk stall may be
+        bool chunk_headers = true;              // Prefix every transfer with a recorder_chunk_header
+        bool direct_io = true;                  // Bypass the page cache (O_DIRECT) where the file system supports it
+        std::chrono::milliseconds flush_interval { 1000 };  // Partially filled blocks are written at least this often,
+                                                            // 0 = only full blocks. With direct I/O the unaligned
+                                                            // tail of a block waits for the next flush.
+        stream_config stream;                   // For reading the endpoint
+        thread_config threads;                  // For the USB and the writer thread
+    };
+
+    // Written in front of every transfer when chunk headers are enabled. The sequence number also counts
+    // dropped transfers, so gaps in the recording can be found.
+    struct recorder_chunk_header {
+        uint32_t magic = LIBUSBCPP_RECORDER_MAGIC;
+        uint32_t length = 0;        // [bytes] Payload following this header
+        uint64_t sequence = 0;
+        uint64_t timestamp = 0;     // [ns] Since the recording was started
+    };
+
+    struct LIBUSBCPP_API recorder_stats {
+        uint64_t bytes_received = 0;
+        uint64_t bytes_written = 0;
+        uint64_t chunks_recorded = 0;
+        uint64_t chunks_dropped = 0;        // No free block was available when the transfer completed
+        uint64_t bytes_dropped = 0;
+        uint64_t backpressure_events = 0;   // Times the USB side found less than half of the blocks free
+        size_t max_queued_blocks = 0;       // Deepest the queue to the disk ever got
+        double write_seconds = 0;           // Time spent inside disk writes
+    };
+
+    // Streams an IN endpoint into a file. The USB thread only copies into preallocated aligned blocks,
+    // a separate writer thread writes full blocks to disk, and what a slow device has put into the current block
+    // every flush_interval. If the disk stalls for longer than the blocks can absorb, transfers are dropped
+    // instead of stalling the USB side.
+    class LIBUSBCPP_API recorder {
+    public:
+        recorder(usb::device device, uint8_t endpoint, const std::string& path, const recorder_config& config = {});
+        ~recorder();
+
+        bool start();
+        void stop();        // Finishes writing everything that was received
+
+        recorder_stats stats();
+
+        recorder(recorder const&) = delete;
+        recorder& operator=(recorder const&) = delete;
+
+    private:
+        struct block {
+            uint8_t* data = nullptr;
+            size_t used = 0;
+        };
+
+        bool on_data(const uint8_t* data, size_t length);
+        void append(const uint8_t* data, size_t length);
+        void submit_current_block();
+        void write_blocks();
+        bool open_file();
+        void close_file();
+
+        usb::device device;
+        uint8_t endpoint = 0x00;
+        std::string path;
+        recorder_config config;
+
+        intptr_t file = -1;             // File descriptor, or FILE* on Windows
+        bool direct_io = false;
+
+        std::vector<block> blocks;
+        std::optional<block> current;
+        std::queue<block> free_blocks;
+        std::queue<block> filled_blocks;
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        bool stopping = false;
+        bool writer_done = false;
+        uint64_t sequence = 0;
+        std::chrono::steady_clock::time_point start_time;
+        recorder_stats _stats;
+
+        std::thread usb_thread;
+        std::thread writer_thread;
+    };
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "libusbcpp.h"
+
+// Timeline tracing of device scans and transfers. Only records anything if the library is built with the
+// LIBUSBCPP_TRACING option, and only while tracing is started. Otherwise every span costs a single relaxed load.
+// The result can be opened in chrome://tracing or https://ui.perfetto.dev
+
+namespace usb::trace {
+
+    LIBUSBCPP_API extern std::atomic<bool> active;
+
+    // Starting again discards everything recorded so far and frees the buffers of threads that have exited. Each
+    // thread records into its own buffer without locking, when it is full further events of that thread are dropped.
+    LIBUSBCPP_API void start(size_t events_per_thread = 64 * 1024);
+    LIBUSBCPP_API void stop();
+
+    // Chrome trace event format. Safe while threads are recording and against a concurrent start(), which waits
+    // for it: The result holds the events recorded up to the call.
+    LIBUSBCPP_API std::string to_json();
+    LIBUSBCPP_API bool save(const std::string& path);
+    LIBUSBCPP_API uint64_t dropped();                   // Events lost to full buffers
+
+    LIBUSBCPP_API uint64_t now();                       // [ns] Since start()
+
+    // Names, categories and argument names are not copied: Use string literals
+    LIBUSBCPP_API void record(const char* name, const char* category, uint64_t begin, uint64_t end,
+                              const char* arg_name = nullptr, uint64_t arg = 0);
+
+    // A span that may overlap others on the same thread, e.g. a transfer from submission to completion
+    LIBUSBCPP_API void record_async(const char* name, const char* category, uint64_t id, uint64_t begin, uint64_t end,
+                                    const char* arg_name = nullptr, uint64_t arg = 0);
+
+    // Records the time from construction to destruction
+    class span {
+    public:
+        span(const char* name, const char* category, const char* arg_name = nullptr, uint64_t arg = 0) {
+            if (active.load(std::memory_order_relaxed)) {
+                this->name = name;
+                this->category = category;
+                this->arg_name = arg_name;
+                this->arg = arg;
+                begin = now();
+            }
+        }
+
+        ~span() {
+            if (name) {
+                record(name, category, begin, now(), arg_name, arg);
+            }
+        }
+
+        void set_arg(const char* arg_name, uint64_t arg) {
+            this->arg_name = arg_name;
+            this->arg = arg;
+        }
+
+        span(span const&) = delete;
+        span& operator=(span const&) = delete;
+
+    private:
+        const char* name = nullptr;     // Stays nullptr if tracing was inactive at construction
+        const char* category = nullptr;
+        const char* arg_name = nullptr;
+        uint64_t arg = 0;
+        uint64_t begin = 0;
+    };
+
+}
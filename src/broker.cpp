@@ -0,0 +1,522 @@
+#include <utility>
+#include <cstring>
+#include "log.h"
+
+#define LIBUSBCPP_EXPORTS
+#include "libusbcpp_broker.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cerrno>
+#endif
+
+namespace usb {
+
+    static constexpr uint32_t BROKER_MAGIC = 0x42555355;
+    static constexpr uint32_t BROKER_VERSION = 3;
+
+    // Layout of the shared memory: This header, followed by the IN ring and the OUT queue
+    struct broker_header {
+        std::atomic<uint32_t> magic;        // Written last, clients can only attach once everything is initialized
+        uint32_t version;
+        uint32_t slot_count;
+        uint32_t slot_size;
+        uint32_t slot_stride;
+        uint32_t out_slot_count;
+        uint32_t out_slot_size;
+        uint32_t out_slot_stride;
+        uint64_t ring_offset;
+        uint64_t out_offset;
+        uint64_t owner_pid;                 // Process of the broker, tells a segment left behind from one in use
+
+        alignas(64) std::atomic<uint64_t> write_index;      // Next message the broker publishes
+        alignas(64) std::atomic<uint64_t> out_enqueue;      // Claimed by the clients
+        alignas(64) std::atomic<uint64_t> out_dequeue;      // Only touched by the broker
+    };
+
+    enum : uint32_t {
+        FRAGMENT_CONTINUED = 1,     // Continues the message in the previous slot
+        FRAGMENT_MORE = 2           // Continues in the next slot
+    };
+
+    // Seqlock: 2n+1 while message n is written, 2n+2 once it is complete
+    struct ring_slot {
+        std::atomic<uint64_t> sequence;
+        uint32_t length;
+        uint32_t flags;
+    };
+
+    // Bounded MPMC queue cell (Vyukov): The sequence tells whether the cell is free or filled for a position
+    struct out_cell {
+        std::atomic<uint64_t> sequence;
+        uint32_t length;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory requires lock-free 64-bit atomics");
+
+    static size_t align_up(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    static ring_slot* get_ring_slot(broker_header* header, uint64_t index) {
+        auto* base = reinterpret_cast<uint8_t*>(header) + header->ring_offset;
+        return reinterpret_cast<ring_slot*>(base + (index & (header->slot_count - 1)) * header->slot_stride);
+    }
+
+    static out_cell* get_out_cell(broker_header* header, uint64_t index) {
+        auto* base = reinterpret_cast<uint8_t*>(header) + header->out_offset;
+        return reinterpret_cast<out_cell*>(base + (index & (header->out_slot_count - 1)) * header->out_slot_stride);
+    }
+
+    static uint8_t* payload(void* cell, size_t header_size) {
+        return reinterpret_cast<uint8_t*>(cell) + header_size;
+    }
+
+    // Clients must not trust the header: Every slot and cell has to lie within the mapped memory
+    static bool layout_fits(const broker_header* header, size_t memory_size) {
+        auto is_power_of_two = [] (uint32_t n) { return n != 0 && (n & (n - 1)) == 0; };
+        auto region_fits = [&] (uint64_t offset, uint64_t count, uint64_t stride, uint64_t entry_size) {
+            if (offset < sizeof(broker_header) || offset % 64 != 0 || stride % 64 != 0 || stride < entry_size)
+                return false;
+            if (offset > memory_size || count > (memory_size - offset) / stride)
+                return false;
+            return true;
+        };
+
+        if (!is_power_of_two(header->slot_count) || !is_power_of_two(header->out_slot_count))
+            return false;
+        if (!region_fits(header->ring_offset, header->slot_count, header->slot_stride,
+                         (uint64_t)sizeof(ring_slot) + header->slot_size))
+            return false;
+        if (!region_fits(header->out_offset, header->out_slot_count, header->out_slot_stride,
+                         (uint64_t)sizeof(out_cell) + header->out_slot_size))
+            return false;
+
+        // The regions must not overlap
+        uint64_t ring_end = header->ring_offset + (uint64_t)header->slot_count * header->slot_stride;
+        uint64_t out_end = header->out_offset + (uint64_t)header->out_slot_count * header->out_slot_stride;
+        return ring_end <= header->out_offset || out_end <= header->ring_offset;
+    }
+
+
+
+
+
+#ifdef _WIN32
+    static std::string shared_memory_name(const std::string& name) {
+        return "Local\\libusbcpp_" + name;
+    }
+
+    static void* create_shared_memory(const std::string& name, size_t size, void*& mapping) {
+        HANDLE handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                           (DWORD)((uint64_t)size >> 32), (DWORD)size, name.c_str());
+        if (!handle) {
+            LOG_ERROR("CreateFileMapping failed for '%s': %lu", name.c_str(), GetLastError());
+            return nullptr;
+        }
+        if (GetLastError() == ERROR_ALREADY_EXISTS) {   // Mappings vanish with their last handle, so it is in use
+            LOG_ERROR("Shared memory '%s' is in use by another broker or its clients", name.c_str());
+            CloseHandle(handle);
+            return nullptr;
+        }
+        void* memory = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (!memory) {
+            LOG_ERROR("MapViewOfFile failed for '%s': %lu", name.c_str(), GetLastError());
+            CloseHandle(handle);
+            return nullptr;
+        }
+        mapping = handle;
+        return memory;
+    }
+
+    static void* open_shared_memory(const std::string& name, size_t& size, void*& mapping) {
+        HANDLE handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        if (!handle)
+            return nullptr;
+
+        void* memory = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        MEMORY_BASIC_INFORMATION info {};
+        if (!memory || !VirtualQuery(memory, &info, sizeof(info))) {
+            LOG_ERROR("MapViewOfFile failed for '%s': %lu", name.c_str(), GetLastError());
+            if (memory) UnmapViewOfFile(memory);
+            CloseHandle(handle);
+            return nullptr;
+        }
+        size = info.RegionSize;
+        mapping = handle;
+        return memory;
+    }
+
+    static void close_shared_memory(void* memory, size_t, void* mapping, const std::string*) {
+        UnmapViewOfFile(memory);
+        CloseHandle((HANDLE)mapping);
+    }
+
+    static uint64_t process_id() {
+        return GetCurrentProcessId();
+    }
+#else
+    static std::string shared_memory_name(const std::string& name) {
+        return "/libusbcpp_" + name;
+    }
+
+    static void* open_shared_memory(const std::string& name, size_t& size, void*&) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(broker_header)) {
+            close(fd);
+            return nullptr;
+        }
+        size = (size_t)st.st_size;
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    // Only if the broker that created it has exited. A segment without an owner may still be in creation, it stays.
+    static bool is_abandoned(const std::string& name) {
+        size_t size = 0;
+        void* mapping = nullptr;
+        void* memory = open_shared_memory(name, size, mapping);
+        if (!memory)
+            return false;
+        auto pid = (pid_t)static_cast<broker_header*>(memory)->owner_pid;
+        munmap(memory, size);
+        return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+    }
+
+    static void* create_shared_memory(const std::string& name, size_t size, void*&) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        int error = fd < 0 ? errno : 0;
+        if (error == EEXIST && is_abandoned(name)) {
+            LOG_WARN("Removing shared memory '%s' left behind by a broker that is gone", name.c_str());
+            shm_unlink(name.c_str());
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            error = fd < 0 ? errno : 0;
+        }
+        if (fd < 0) {
+            if (error == EEXIST) {
+                LOG_ERROR("Shared memory '%s' is in use by another broker", name.c_str());
+            }
+            else {
+                LOG_ERROR("shm_open failed for '%s': %s", name.c_str(), strerror(error));
+            }
+            return nullptr;
+        }
+        if (ftruncate(fd, (off_t)size) != 0) {
+            LOG_ERROR("ftruncate failed for '%s': %s", name.c_str(), strerror(errno));
+            close(fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (memory == MAP_FAILED) {
+            LOG_ERROR("mmap failed for '%s': %s", name.c_str(), strerror(errno));
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+        return memory;
+    }
+
+    static void close_shared_memory(void* memory, size_t size, void*, const std::string* unlink_name) {
+        munmap(memory, size);
+        if (unlink_name) {
+            shm_unlink(unlink_name->c_str());
+        }
+    }
+
+    static uint64_t process_id() {
+        return (uint64_t)getpid();
+    }
+#endif
+
+
+
+
+
+    LIBUSBCPP_API device_broker::device_broker(const std::string& name, const broker_config& config)
+        : device_broker(nullptr, name, config) {}
+
+    LIBUSBCPP_API device_broker::device_broker(usb::device device, const std::string& name, const broker_config& config)
+        : device(std::move(device)), config(config), name(shared_memory_name(name)) {
+
+        auto is_power_of_two = [] (uint32_t n) { return n != 0 && (n & (n - 1)) == 0; };
+        if (!is_power_of_two(config.slot_count) || !is_power_of_two(config.out_slot_count)) {
+            LOG_ERROR("Broker slot counts must be powers of two");
+            throw std::runtime_error("[libusbcpp]: Broker slot counts must be powers of two!");
+        }
+
+        broker_header layout {};
+        layout.slot_count = config.slot_count;
+        layout.slot_size = config.slot_size;
+        layout.slot_stride = (uint32_t)align_up(sizeof(ring_slot) + config.slot_size, 64);
+        layout.out_slot_count = config.out_slot_count;
+        layout.out_slot_size = config.out_slot_size;
+        layout.out_slot_stride = (uint32_t)align_up(sizeof(out_cell) + config.out_slot_size, 64);
+        layout.ring_offset = align_up(sizeof(broker_header), 64);
+        layout.out_offset = layout.ring_offset + (uint64_t)layout.slot_count * layout.slot_stride;
+        memory_size = layout.out_offset + (uint64_t)layout.out_slot_count * layout.out_slot_stride;
+
+        memory = create_shared_memory(this->name, memory_size, mapping);
+        if (!memory) {
+            throw std::runtime_error("[libusbcpp]: Shared memory for the broker could not be created!");
+        }
+
+        auto* header = new (memory) broker_header();
+        header->version = BROKER_VERSION;
+        header->slot_count = layout.slot_count;
+        header->slot_size = layout.slot_size;
+        header->slot_stride = layout.slot_stride;
+        header->out_slot_count = layout.out_slot_count;
+        header->out_slot_size = layout.out_slot_size;
+        header->out_slot_stride = layout.out_slot_stride;
+        header->ring_offset = layout.ring_offset;
+        header->out_offset = layout.out_offset;
+        header->owner_pid = process_id();
+
+        for (uint64_t i = 0; i < header->slot_count; i++) {
+            new (get_ring_slot(header, i)) ring_slot { { 0 }, 0, 0 };
+        }
+        for (uint64_t i = 0; i < header->out_slot_count; i++) {
+            new (get_out_cell(header, i)) out_cell { { i }, 0 };
+        }
+        header->magic.store(BROKER_MAGIC, std::memory_order_release);
+    }
+
+    LIBUSBCPP_API device_broker::~device_broker() {
+        stop_async();
+        static_cast<broker_header*>(memory)->magic.store(0, std::memory_order_release);
+        close_shared_memory(memory, memory_size, mapping, &name);
+    }
+
+    LIBUSBCPP_API void device_broker::run_async() {
+        if (!device || in_thread.joinable() || out_thread.joinable())
+            return;
+
+        terminate = false;
+        if (config.in_endpoint) {
+            in_thread = std::thread([this] {
+                configure_this_thread(config.threads, "broker-in");
+                device->stream_read(config.in_endpoint, [this] (const uint8_t* data, size_t length) {
+                    publish(data, length);
+                    return !terminate;
+                }, config.stream);
+            });
+        }
+
+        if (config.out_endpoint) {
+            out_thread = std::thread([this] {
+                configure_this_thread(config.threads, "broker-out");
+                while (!terminate) {
+                    size_t handled = poll_requests([this] (const uint8_t* data, size_t length) {
+                        device->bulk_write(const_cast<uint8_t*>(data), length, config.out_endpoint);
+                    });
+                    if (handled == 0) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    }
+                }
+            });
+        }
+    }
+
+    LIBUSBCPP_API void device_broker::stop_async() {
+        terminate = true;
+        if (in_thread.joinable()) {
+            in_thread.join();
+        }
+        if (out_thread.joinable()) {
+            out_thread.join();
+        }
+    }
+
+    LIBUSBCPP_API bool device_broker::publish(const uint8_t* data, size_t length) {
+        auto* header = static_cast<broker_header*>(memory);
+
+        uint32_t continued = 0;
+        while (length > 0) {
+            size_t chunk = std::min<size_t>(length, header->slot_size);
+            uint64_t index = header->write_index.load(std::memory_order_relaxed);     // Only the broker writes
+            ring_slot* slot = get_ring_slot(header, index);
+
+            slot->sequence.store(2 * index + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(payload(slot, sizeof(ring_slot)), data, chunk);
+            slot->length = (uint32_t)chunk;
+            slot->flags = continued | (chunk < length ? (uint32_t)FRAGMENT_MORE : 0u);
+            slot->sequence.store(2 * index + 2, std::memory_order_release);
+            header->write_index.store(index + 1, std::memory_order_release);
+
+            data += chunk;
+            length -= chunk;
+            continued = FRAGMENT_CONTINUED;
+        }
+        return true;
+    }
+
+    LIBUSBCPP_API size_t device_broker::poll_requests(const std::function<void(const uint8_t*, size_t)>& handler) {
+        auto* header = static_cast<broker_header*>(memory);
+        size_t count = 0;
+
+        while (true) {
+            uint64_t position = header->out_dequeue.load(std::memory_order_relaxed);
+            out_cell* cell = get_out_cell(header, position);
+            uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            if (sequence != position + 1) {
+                if (sequence != position || header->out_enqueue.load(std::memory_order_relaxed) == position)
+                    break;      // Empty
+
+                // A client is still writing this cell. If it takes too long, it probably died in the middle of send().
+                auto now = std::chrono::steady_clock::now();
+                if (stalled_position != position) {
+                    stalled_position = position;
+                    stalled_since = now;
+                }
+                if (now - stalled_since < config.out_claim_timeout)
+                    break;
+                if (!cell->sequence.compare_exchange_strong(sequence, position + header->out_slot_count,
+                                                            std::memory_order_acq_rel))
+                    continue;   // It finished just now
+                LOG_WARN("Skipped an OUT request that was never completed, the client may have died");
+                header->out_dequeue.store(position + 1, std::memory_order_relaxed);
+                continue;
+            }
+
+            header->out_dequeue.store(position + 1, std::memory_order_relaxed);
+            handler(payload(cell, sizeof(out_cell)), std::min(cell->length, header->out_slot_size));
+            cell->sequence.store(position + header->out_slot_count, std::memory_order_release);
+            count++;
+        }
+        return count;
+    }
+
+
+
+
+
+    LIBUSBCPP_API broker_client::broker_client(const std::string& name) {
+        std::string _name = shared_memory_name(name);
+        memory = open_shared_memory(_name, memory_size, mapping);
+        if (!memory) {
+            LOG_ERROR("No broker found with the name '%s'", name.c_str());
+            throw std::runtime_error("[libusbcpp]: No broker found with this name!");
+        }
+
+        auto* header = static_cast<broker_header*>(memory);
+        if (header->magic.load(std::memory_order_acquire) != BROKER_MAGIC || header->version != BROKER_VERSION) {
+            close_shared_memory(memory, memory_size, mapping, nullptr);
+            LOG_ERROR("Broker '%s' is not running or has an incompatible version", name.c_str());
+            throw std::runtime_error("[libusbcpp]: Broker is not running or has an incompatible version!");
+        }
+        if (!layout_fits(header, memory_size)) {
+            close_shared_memory(memory, memory_size, mapping, nullptr);
+            LOG_ERROR("Shared memory of broker '%s' does not match its layout", name.c_str());
+            throw std::runtime_error("[libusbcpp]: Shared memory of the broker does not match its layout!");
+        }
+        position = header->write_index.load(std::memory_order_acquire);
+    }
+
+    LIBUSBCPP_API broker_client::~broker_client() {
+        close_shared_memory(memory, memory_size, mapping, nullptr);
+    }
+
+    LIBUSBCPP_API std::optional<broker_message> broker_client::acquire() {
+        auto* header = static_cast<broker_header*>(memory);
+
+        while (true) {
+            uint64_t written = header->write_index.load(std::memory_order_acquire);
+            if (position >= written)
+                return std::nullopt;
+
+            if (written - position > header->slot_count) {     // We fell behind by more than the whole ring
+                lost_messages += written - position - header->slot_count;
+                position = written - header->slot_count;
+            }
+
+            auto* slot = get_ring_slot(header, position);
+            uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+            if (sequence != 2 * position + 2) {     // Already overwritten by a newer message
+                lost_messages++;
+                position++;
+                continue;
+            }
+
+            acquired_slot = slot;
+            acquired_sequence = sequence;
+
+            broker_message message;
+            message.data = payload(slot, sizeof(ring_slot));
+            message.length = std::min(slot->length, header->slot_size);
+            message.sequence = position;
+            message.continued = slot->flags & FRAGMENT_CONTINUED;
+            message.more = slot->flags & FRAGMENT_MORE;
+            return message;
+        }
+    }
+
+    LIBUSBCPP_API bool broker_client::release() {
+        if (!acquired_slot)
+            return false;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto* slot = static_cast<const ring_slot*>(acquired_slot);
+        bool valid = slot->sequence.load(std::memory_order_relaxed) == acquired_sequence;
+
+        acquired_slot = nullptr;
+        position++;
+        if (!valid) {
+            lost_messages++;
+        }
+        return valid;
+    }
+
+    LIBUSBCPP_API bool broker_client::send(const uint8_t* data, size_t length) {
+        auto* header = static_cast<broker_header*>(memory);
+        if (length > header->out_slot_size)
+            return false;
+
+        uint64_t position = header->out_enqueue.load(std::memory_order_relaxed);
+        out_cell* cell;
+        while (true) {
+            cell = get_out_cell(header, position);
+            uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = (int64_t)(sequence - position);
+            if (difference == 0) {
+                if (header->out_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;      // The cell is ours
+            }
+            else if (difference < 0) {
+                return false;   // Full
+            }
+            else {
+                position = header->out_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+
+        memcpy(payload(cell, sizeof(out_cell)), data, length);
+        cell->length = (uint32_t)length;
+
+        // Fails if the broker gave up on the cell because this took longer than out_claim_timeout
+        uint64_t expected = position;
+        return cell->sequence.compare_exchange_strong(expected, position + 1, std::memory_order_release,
+                                                      std::memory_order_relaxed);
+    }
+
+    LIBUSBCPP_API bool broker_client::send(const std::string& data) {
+        return send(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    }
+
+    LIBUSBCPP_API uint64_t broker_client::lost() const {
+        return lost_messages;
+    }
+
+}
@@ -0,0 +1,117 @@
+#include <utility>
+#include <iterator>
+#include "libusb.h"
+#include "log.h"
+
+#define LIBUSBCPP_EXPORTS
+#include "libusbcpp_context_pool.h"
+
+namespace usb {
+
+    LIBUSBCPP_API std::vector<usb::device> open_devices(libusb_context* context,
+                                                        const std::function<bool(const device_properties&)>& filter);
+
+    LIBUSBCPP_API context_pool::context_pool(const context_pool_config& config) : config(config) {
+        if (this->config.shards == 0) {
+            LOG_ERROR("A context pool needs at least one shard");
+            throw std::runtime_error("[libusbcpp]: A context pool needs at least one shard!");
+        }
+
+        const auto& cpus = this->config.threads.cpus;
+        for (size_t i = 0; i < this->config.shards; i++) {
+            thread_config threads = this->config.threads;
+            if (!cpus.empty()) {
+                threads.cpus = { cpus[i % cpus.size()] };
+            }
+            auto& shard = shards.emplace_back(std::make_unique<shard_state>());
+            shard->context = std::make_unique<usb::context>(threads);
+        }
+
+        // Started only once all contexts exist, a failing context constructor leaves no thread behind
+        for (size_t i = 0; i < shards.size(); i++) {
+            shard_state& shard = *shards[i];
+            shard.thread = std::thread([this, &shard, i] {
+                configure_this_thread(shard.context->threads(), "events" + std::to_string(i));
+                handle_events(shard);
+            });
+        }
+    }
+
+    LIBUSBCPP_API context_pool::~context_pool() {
+        terminate = true;
+        for (auto& shard : shards) {
+            libusb_interrupt_event_handler(*shard->context);
+        }
+        for (auto& shard : shards) {
+            if (shard->thread.joinable()) {
+                shard->thread.join();
+            }
+        }
+    }
+
+    LIBUSBCPP_API size_t context_pool::size() const {
+        return shards.size();
+    }
+
+    LIBUSBCPP_API usb::context& context_pool::shard(size_t index) {
+        return *shards.at(index)->context;
+    }
+
+    LIBUSBCPP_API size_t context_pool::shard_for(const device_properties& device) {
+        std::string key;
+        if (config.placement == shard_placement::BY_HUB) {
+            key = std::to_string(device.bus_number) + "-";      // Port path without the last port
+            for (uint8_t i = 0; i + 1 < device.port_depth; i++) {
+                key += (i > 0 ? "." : "") + std::to_string(device.port_numbers[i]);
+            }
+        }
+        else {
+            key = device.port_path();
+        }
+
+        std::lock_guard<std::mutex> lock(placement_mutex);
+        auto [it, inserted] = placements.try_emplace(key, next_shard);
+        if (inserted) {
+            next_shard = (next_shard + 1) % shards.size();
+        }
+        return it->second;
+    }
+
+    LIBUSBCPP_API std::vector<usb::device> context_pool::find_devices(uint16_t vendor_id, uint16_t product_id) {
+        return find_devices([&] (const device_properties& device) {
+            return device.vendor_id == vendor_id && device.product_id == product_id;
+        });
+    }
+
+    LIBUSBCPP_API std::vector<usb::device> context_pool::find_devices(
+                const std::function<bool(const device_properties&)>& filter) {
+        std::vector<usb::device> devices;
+
+        // One pass over the bus per shard, each opens only the devices that belong to it
+        for (size_t i = 0; i < shards.size(); i++) {
+            auto opened = open_devices(*shards[i]->context, [&] (const device_properties& properties) {
+                if (properties.port_depth == 0)
+                    return false;   // Root hubs have no port path
+                return filter(properties) && shard_for(properties) == i;
+            });
+            std::move(opened.begin(), opened.end(), std::back_inserter(devices));
+        }
+        return devices;
+    }
+
+    LIBUSBCPP_API uint64_t context_pool::events_handled(size_t index) const {
+        return shards.at(index)->events.load(std::memory_order_relaxed);
+    }
+
+    LIBUSBCPP_API void context_pool::handle_events(shard_state& shard) {
+        while (!terminate) {
+            struct timeval tv = { 0, 100000 };
+            int status = libusb_handle_events_timeout_completed(*shard.context, &tv, nullptr);
+            if (status != LIBUSB_SUCCESS && status != LIBUSB_ERROR_INTERRUPTED) {
+                LOG_ERROR("Failed to handle libusb events: %s", libusb_strerror(status));
+            }
+            shard.events.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+}
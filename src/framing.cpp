@@ -0,0 +1,513 @@
+#include <utility>
+#include <algorithm>
+#include <cstring>
+#include "libusb.h"
+#include "log.h"
+
+#define LIBUSBCPP_EXPORTS
+#include "libusbcpp_framing.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define LIBUSBCPP_FRAMING_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+    #include <arm_neon.h>
+    #define LIBUSBCPP_FRAMING_NEON
+#endif
+
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+namespace usb {
+
+    static constexpr uint8_t SLIP_END = 0xC0;
+    static constexpr uint8_t SLIP_ESC = 0xDB;
+    static constexpr uint8_t SLIP_ESC_END = 0xDC;
+    static constexpr uint8_t SLIP_ESC_ESC = 0xDD;
+    static constexpr size_t DECODE_ERROR = SIZE_MAX;
+
+    // Slicing-by-8: Eight bytes per step, each looked up in its own table
+    struct crc_tables {
+        uint16_t crc16[8][256];
+        uint32_t crc32[8][256];
+    };
+
+    static constexpr crc_tables make_crc_tables() {
+        crc_tables tables {};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint16_t c16 = (uint16_t)(i << 8);
+            uint32_t c32 = i;
+            for (int bit = 0; bit < 8; bit++) {
+                c16 = (c16 & 0x8000) ? (uint16_t)((c16 << 1) ^ 0x1021) : (uint16_t)(c16 << 1);
+                c32 = (c32 & 1) ? (c32 >> 1) ^ 0xEDB88320 : c32 >> 1;
+            }
+            tables.crc16[0][i] = c16;
+            tables.crc32[0][i] = c32;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint16_t previous16 = tables.crc16[k - 1][i];
+                tables.crc16[k][i] = (uint16_t)(previous16 << 8) ^ tables.crc16[0][previous16 >> 8];
+                uint32_t previous = tables.crc32[k - 1][i];
+                tables.crc32[k][i] = (previous >> 8) ^ tables.crc32[0][previous & 0xFF];
+            }
+        }
+        return tables;
+    }
+
+    static constexpr crc_tables tables = make_crc_tables();
+
+    LIBUSBCPP_API uint16_t crc16(const uint8_t* data, size_t length, uint16_t crc) {
+        const auto& t = tables.crc16;
+        while (length >= 8) {
+            uint16_t word = crc ^ (uint16_t)(data[0] << 8 | data[1]);
+            crc = t[7][word >> 8] ^ t[6][word & 0xFF] ^ t[5][data[2]] ^ t[4][data[3]]
+                  ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+            data += 8;
+            length -= 8;
+        }
+        while (length-- > 0) {
+            crc = (uint16_t)((crc << 8) ^ t[0][((crc >> 8) ^ *data++) & 0xFF]);
+        }
+        return crc;
+    }
+
+    LIBUSBCPP_API uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc) {
+        const auto& t = tables.crc32;
+        uint32_t c = ~crc;
+        while (length >= 8) {
+            uint32_t word = c ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16
+                                 | (uint32_t)data[3] << 24);
+            c = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^ t[5][(word >> 16) & 0xFF] ^ t[4][word >> 24]
+                ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+            data += 8;
+            length -= 8;
+        }
+        while (length-- > 0) {
+            c = (c >> 8) ^ t[0][(c ^ *data++) & 0xFF];
+        }
+        return ~c;
+    }
+
+    static inline unsigned count_trailing_zeros(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, value);
+        return (unsigned)index;
+#else
+        return (unsigned)__builtin_ctzll(value);
+#endif
+    }
+
+    // Delimiters are usually a few dozen bytes apart, where inline vector code beats a call to memchr.
+    // Longer runs are left to memchr, which uses the widest vectors the CPU has (e.g. AVX2 in glibc).
+    static constexpr size_t INLINE_SEARCH_LIMIT = 256;
+
+    LIBUSBCPP_API const uint8_t* find_byte(const uint8_t* begin, const uint8_t* end, uint8_t value) {
+        const uint8_t* inline_end = end - begin > (ptrdiff_t)INLINE_SEARCH_LIMIT ? begin + INLINE_SEARCH_LIMIT : end;
+#if defined(LIBUSBCPP_FRAMING_SSE2)
+        const __m128i needle = _mm_set1_epi8((char)value);
+        while (inline_end - begin >= 32) {     // Two vectors per step, only one branch for both
+            __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)begin), needle);
+            __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(begin + 16)), needle);
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(a) | (uint32_t)_mm_movemask_epi8(b) << 16;
+            if (mask != 0)
+                return begin + count_trailing_zeros(mask);
+            begin += 32;
+        }
+        if (inline_end - begin >= 16) {
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)begin), needle));
+            if (mask != 0)
+                return begin + count_trailing_zeros(mask);
+            begin += 16;
+        }
+#elif defined(LIBUSBCPP_FRAMING_NEON)
+        const uint8x16_t needle = vdupq_n_u8(value);
+        while (inline_end - begin >= 16) {
+            uint8x16_t equal = vceqq_u8(vld1q_u8(begin), needle);
+            // Narrowing turns every byte of the comparison into 4 bits of a 64 bit mask
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(equal), 4)), 0);
+            if (mask != 0)
+                return begin + (count_trailing_zeros(mask) >> 2);
+            begin += 16;
+        }
+#else
+        (void)inline_end;
+#endif
+        auto* found = static_cast<const uint8_t*>(memchr(begin, value, (size_t)(end - begin)));
+        return found ? found : end;
+    }
+
+    static size_t checksum_size(frame_checksum checksum) {
+        switch (checksum) {
+            case frame_checksum::CRC16: return 2;
+            case frame_checksum::CRC32: return 4;
+            default: return 0;
+        }
+    }
+
+    static uint32_t checksum_initial(frame_checksum checksum) {
+        return checksum == frame_checksum::CRC16 ? 0xFFFF : 0;
+    }
+
+    static uint32_t update_checksum(frame_checksum checksum, const uint8_t* data, size_t length, uint32_t crc) {
+        if (checksum == frame_checksum::CRC16)
+            return crc16(data, length, (uint16_t)crc);
+        return crc32(data, length, crc);
+    }
+
+    static uint32_t read_le(const uint8_t* data, size_t bytes) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < bytes; i++) {
+            value |= (uint32_t)data[i] << (8 * i);
+        }
+        return value;
+    }
+
+    // Decoded data is never longer than the encoded data, so decoding works in place
+    static size_t cobs_decode(uint8_t* data, size_t length) {
+        uint8_t* out = data;
+        const uint8_t* in = data;
+        const uint8_t* last = data + length;
+        while (in < last) {
+            uint8_t code = *in++;
+            size_t count = (size_t)code - 1;
+            if (code == 0 || count > (size_t)(last - in))
+                return DECODE_ERROR;
+
+            memmove(out, in, count);
+            out += count;
+            in += count;
+            if (code != 0xFF && in < last) {
+                *out++ = 0x00;
+            }
+        }
+        return (size_t)(out - data);
+    }
+
+    static size_t slip_decode(uint8_t* data, size_t length) {
+        uint8_t* out = data;
+        const uint8_t* in = data;
+        const uint8_t* last = data + length;
+        while (in < last) {
+            const uint8_t* escape = find_byte(in, last, SLIP_ESC);
+            size_t count = (size_t)(escape - in);
+            if (out != in) {
+                memmove(out, in, count);
+            }
+            out += count;
+            in = escape;
+            if (in == last)
+                break;
+
+            if (in + 1 == last)
+                return DECODE_ERROR;
+            if (in[1] == SLIP_ESC_END) {
+                *out++ = SLIP_END;
+            }
+            else if (in[1] == SLIP_ESC_ESC) {
+                *out++ = SLIP_ESC;
+            }
+            else {
+                return DECODE_ERROR;
+            }
+            in += 2;
+        }
+        return (size_t)(out - data);
+    }
+
+    LIBUSBCPP_API size_t encode_frame(const framing_config& config, const uint8_t* data, size_t length,
+                                      std::vector<uint8_t>& out) {
+        size_t start = out.size();
+        size_t csize = checksum_size(config.checksum);
+        uint8_t trailer[4];
+        if (csize > 0) {
+            uint32_t crc = update_checksum(config.checksum, data, length, checksum_initial(config.checksum));
+            for (size_t i = 0; i < csize; i++) {
+                trailer[i] = (uint8_t)(crc >> (8 * i));
+            }
+        }
+
+        switch (config.codec) {
+            case frame_codec::LENGTH_PREFIXED: {
+                uint64_t frame_length = length + csize;
+                if (config.length_bytes < 4 && frame_length >> (8 * config.length_bytes) != 0) {
+                    LOG_ERROR("Frame of %zu bytes does not fit into a %zu byte length field", length,
+                              config.length_bytes);
+                    return 0;
+                }
+                for (size_t i = 0; i < config.length_bytes; i++) {
+                    out.push_back((uint8_t)(frame_length >> (8 * i)));
+                }
+                out.insert(out.end(), data, data + length);
+                out.insert(out.end(), trailer, trailer + csize);
+                break;
+            }
+
+            case frame_codec::COBS: {
+                size_t code_position = out.size();
+                uint8_t code = 1;
+                out.push_back(0x00);    // Placeholder for the first code
+                auto put = [&] (uint8_t byte) {
+                    if (byte != 0x00) {
+                        out.push_back(byte);
+                        code++;
+                    }
+                    if (byte == 0x00 || code == 0xFF) {
+                        out[code_position] = code;
+                        code_position = out.size();
+                        out.push_back(0x00);
+                        code = 1;
+                    }
+                };
+                for (size_t i = 0; i < length; i++) {
+                    put(data[i]);
+                }
+                for (size_t i = 0; i < csize; i++) {
+                    put(trailer[i]);
+                }
+                out[code_position] = code;
+                out.push_back(0x00);
+                break;
+            }
+
+            case frame_codec::SLIP: {
+                auto put = [&] (uint8_t byte) {
+                    if (byte == SLIP_END) {
+                        out.push_back(SLIP_ESC);
+                        out.push_back(SLIP_ESC_END);
+                    }
+                    else if (byte == SLIP_ESC) {
+                        out.push_back(SLIP_ESC);
+                        out.push_back(SLIP_ESC_ESC);
+                    }
+                    else {
+                        out.push_back(byte);
+                    }
+                };
+                for (size_t i = 0; i < length; i++) {
+                    put(data[i]);
+                }
+                for (size_t i = 0; i < csize; i++) {
+                    put(trailer[i]);
+                }
+                out.push_back(SLIP_END);
+                break;
+            }
+        }
+        return out.size() - start;
+    }
+
+    LIBUSBCPP_API frame_receiver::frame_receiver(const framing_config& config) : config(config) {
+        if (config.length_bytes != 1 && config.length_bytes != 2 && config.length_bytes != 4) {
+            LOG_ERROR("Length field must be 1, 2 or 4 bytes, not %zu", config.length_bytes);
+            throw std::runtime_error("[libusbcpp]: Invalid length field size for framing!");
+        }
+        buffer.resize(std::max(config.buffer_size, 2 * config.max_frame_size + 2));
+    }
+
+    LIBUSBCPP_API uint8_t* frame_receiver::prepare(size_t& size) {
+        // Move the unprocessed rest to the front once the free space runs low, this invalidates all views
+        if (begin > 0 && (begin == end || buffer.size() - end < buffer.size() / 2)) {
+            memmove(buffer.data(), buffer.data() + begin, end - begin);
+            end -= begin;
+            scanned -= begin;
+            crc_position = crc_position > begin ? crc_position - begin : 0;
+            begin = 0;
+        }
+
+        if (end == buffer.size()) {     // A single frame fills the whole buffer
+            if (!skipping) {
+                _stats.oversized++;
+            }
+            skipping = config.codec != frame_codec::LENGTH_PREFIXED;
+            begin = end = scanned = crc_position = 0;
+        }
+
+        size = buffer.size() - end;
+        return buffer.data() + end;
+    }
+
+    LIBUSBCPP_API void frame_receiver::commit(size_t length) {
+        end = std::min(end + length, buffer.size());
+    }
+
+    LIBUSBCPP_API std::optional<frame_view> frame_receiver::next() {
+        switch (config.codec) {
+            case frame_codec::COBS:
+                return next_delimited(0x00);
+            case frame_codec::SLIP:
+                return next_delimited(SLIP_END);
+            default:
+                return next_length_prefixed();
+        }
+    }
+
+    LIBUSBCPP_API size_t frame_receiver::receive(basic_device& device, uint8_t endpoint, uint32_t timeout) {
+        size_t size = 0;
+        uint8_t* data = prepare(size);
+        if (spill_begin < spill_end) {      // Rest of the last packet first, it arrived before anything new
+            size_t count = std::min(size, spill_end - spill_begin);
+            memcpy(data, spill.data() + spill_begin, count);
+            spill_begin += count;
+            commit(count);
+            return count;
+        }
+
+        // Only read whole packets, a packet longer than the space left would fail the transfer with an overflow
+        const endpoint_info* ep = device.find_endpoint((uint8_t)(endpoint | LIBUSB_ENDPOINT_IN));
+        if (!ep || ep->max_packet_size == 0) {
+            LOG_ERROR("Cannot receive frames: Endpoint 0x%02X is not an IN endpoint of the device", endpoint);
+            return 0;
+        }
+        size_t packet = ep->max_packet_size;
+        if (size >= packet) {
+            size_t length = device.bulk_read_into(endpoint, data, size - size % packet, timeout);
+            commit(length);
+            return length;
+        }
+
+        // Less than one packet free: Read a whole one aside and keep what does not fit for the next call
+        spill.resize(packet);
+        size_t length = device.bulk_read_into(endpoint, spill.data(), packet, timeout);
+        size_t count = std::min(size, length);
+        memcpy(data, spill.data(), count);
+        spill_begin = count;
+        spill_end = length;
+        commit(count);
+        return count;
+    }
+
+    LIBUSBCPP_API void frame_receiver::feed(const uint8_t* data, size_t length,
+                                            const std::function<void(const frame_view&)>& handler) {
+        while (length > 0) {
+            size_t size = 0;
+            uint8_t* space = prepare(size);
+            size_t count = std::min(size, length);
+            memcpy(space, data, count);
+            commit(count);
+            data += count;
+            length -= count;
+
+            while (auto frame = next()) {
+                handler(*frame);
+            }
+        }
+    }
+
+    LIBUSBCPP_API void frame_receiver::reset() {
+        begin = end = scanned = crc_position = 0;
+        spill_begin = spill_end = 0;
+        skipping = false;
+    }
+
+    LIBUSBCPP_API const framing_stats& frame_receiver::stats() const {
+        return _stats;
+    }
+
+    LIBUSBCPP_API std::optional<frame_view> frame_receiver::next_delimited(uint8_t delimiter) {
+        while (true) {
+            const uint8_t* base = buffer.data();
+            const uint8_t* found = find_byte(base + scanned, base + end, delimiter);
+            if (found == base + end) {
+                scanned = end;
+                if (!skipping && end - begin > config.max_frame_size) {
+                    skipping = true;
+                    _stats.oversized++;
+                }
+                if (skipping) {
+                    begin = end;    // Nothing of this frame is needed anymore
+                }
+                return std::nullopt;
+            }
+
+            size_t position = (size_t)(found - base);
+            uint8_t* frame = buffer.data() + begin;
+            size_t length = position - begin;
+            begin = scanned = position + 1;
+
+            if (skipping) {
+                skipping = false;
+                continue;
+            }
+            if (length == 0)
+                continue;   // Consecutive delimiters
+            if (length > config.max_frame_size) {
+                _stats.oversized++;
+                continue;
+            }
+
+            size_t decoded = delimiter == 0x00 ? cobs_decode(frame, length) : slip_decode(frame, length);
+            if (decoded == DECODE_ERROR) {
+                _stats.decode_errors++;
+                continue;
+            }
+            if (auto view = check(frame, decoded))
+                return view;
+        }
+    }
+
+    LIBUSBCPP_API std::optional<frame_view> frame_receiver::next_length_prefixed() {
+        size_t header = config.length_bytes;
+        size_t csize = checksum_size(config.checksum);
+        while (end - begin >= header) {
+            size_t length = read_le(buffer.data() + begin, header);
+            if (header + length > config.max_frame_size) {
+                // Without delimiters there is no way to find the next frame, everything received is dropped
+                _stats.oversized++;
+                begin = end = scanned = crc_position = 0;
+                return std::nullopt;
+            }
+
+            size_t frame = begin + header;
+            if (csize > 0 && length >= csize) {
+                // Checksum whatever arrived so far, a frame spread over many reads is still only read once
+                if (crc_position < frame) {
+                    crc_position = frame;
+                    crc = checksum_initial(config.checksum);
+                }
+                size_t checked = std::min(end, frame + length - csize);
+                if (checked > crc_position) {
+                    crc = update_checksum(config.checksum, buffer.data() + crc_position, checked - crc_position, crc);
+                    crc_position = checked;
+                }
+            }
+
+            if (end - frame < length)
+                return std::nullopt;
+            begin = frame + length;
+
+            if (length < csize) {
+                _stats.checksum_errors++;
+                continue;
+            }
+            if (csize > 0 && read_le(buffer.data() + frame + length - csize, csize) != crc) {
+                _stats.checksum_errors++;
+                continue;
+            }
+            _stats.frames++;
+            return frame_view { buffer.data() + frame, length - csize };
+        }
+        return std::nullopt;
+    }
+
+    LIBUSBCPP_API std::optional<frame_view> frame_receiver::check(uint8_t* frame, size_t length) {
+        size_t csize = checksum_size(config.checksum);
+        if (length < csize) {
+            _stats.checksum_errors++;
+            return std::nullopt;
+        }
+        if (csize > 0) {
+            uint32_t expected = update_checksum(config.checksum, frame, length - csize,
+                                                checksum_initial(config.checksum));
+            if (read_le(frame + length - csize, csize) != expected) {
+                _stats.checksum_errors++;
+                return std::nullopt;
+            }
+        }
+        _stats.frames++;
+        return frame_view { frame, length - csize };
+    }
+
+}
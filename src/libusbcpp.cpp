@@ -1,10 +1,18 @@
 
 #include <utility>
+#include <algorithm>
+#include <map>
+#include <cstdlib>
 #include "libusb.h"
 #include "log.h"
 
 #define LIBUSBCPP_EXPORTS
 #include "libusbcpp.h"
+#include "trace.h"
+
+namespace usb {
+    static void clear_device_cache(libusb_context* context);
+}
 
 #define MAKE_EXCEPTION(msg) std::runtime_error("[libusbcpp] " msg)
 #define THROW_AND_LOG(msg) LOG_ERROR("Exception: " msg); throw MAKE_EXCEPTION(msg)
@@ -38,8 +46,13 @@ namespace usb {
         }
     }
 
+    LIBUSBCPP_API context::context(const thread_config& threads) : context() {
+        _threads = threads;
+    }
+
     LIBUSBCPP_API context::~context() {
         LOG_DEBUG("Destroying libusb context");
+        clear_device_cache(_context);
         libusb_exit(_context);
     }
 
@@ -47,15 +60,29 @@ namespace usb {
         return _context;
     }
 
+    LIBUSBCPP_API const thread_config& context::threads() const {
+        return _threads;
+    }
 
 
 
 
 
 
-    LIBUSBCPP_API basic_device::basic_device(libusb_device_handle* handle, usb::device_info info)
-      : handle(handle), info(std::move(info)
-    ) {
+
+    LIBUSBCPP_API basic_device::basic_device(libusb_device_handle* handle, const usb::device_info& info,
+                                             libusb_context* context, std::pmr::memory_resource* resource)
+      : info(info, resource ? resource : std::pmr::get_default_resource()), handle(handle), context(context),
+        resource(resource ? resource : std::pmr::get_default_resource()), interfaces(this->resource) {
+        if (!handle) {
+            close();
+        }
+    }
+
+    LIBUSBCPP_API basic_device::basic_device(libusb_device_handle* handle, const pmr::device_info& info,
+                                             libusb_context* context, std::pmr::memory_resource* resource)
+      : info(info, resource ? resource : std::pmr::get_default_resource()), handle(handle), context(context),
+        resource(resource ? resource : std::pmr::get_default_resource()), interfaces(this->resource) {
         if (!handle) {
             close();
         }
@@ -96,7 +123,128 @@ namespace usb {
         return handle;
     }
 
+    LIBUSBCPP_API const configuration_info& basic_device::configuration() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (config)
+            return *config;
+
+        static const configuration_info empty;
+        if (!handle) {
+            LOG_ERROR("Cannot read configuration: Device is not open");
+            return empty;
+        }
+        config.emplace(configuration_info { 0, speed::UNKNOWN, std::pmr::vector<interface_info>(resource),
+                                            std::pmr::vector<endpoint_info>(resource) });
+
+        libusb_device* device = libusb_get_device(handle);
+        config->speed = (enum speed)libusb_get_device_speed(device);
+
+        libusb_config_descriptor* descriptor = nullptr;
+        int status = libusb_get_active_config_descriptor(device, &descriptor);
+        if (status != LIBUSB_SUCCESS) {
+            LOG_ERROR("Cannot read active configuration descriptor: %s", libusb_strerror(status));
+            config.reset();     // Not cached, the next lookup tries again
+            return empty;
+        }
+
+        config->value = descriptor->bConfigurationValue;
+        for (uint8_t i = 0; i < descriptor->bNumInterfaces; i++) {
+            for (int j = 0; j < descriptor->interface[i].num_altsetting; j++) {
+                auto& alt = descriptor->interface[i].altsetting[j];
+
+                interface_info iface;
+                iface.number = alt.bInterfaceNumber;
+                iface.alt_setting = alt.bAlternateSetting;
+                iface.interface_class = alt.bInterfaceClass;
+                iface.subclass = alt.bInterfaceSubClass;
+                iface.protocol = alt.bInterfaceProtocol;
+                iface.first_endpoint = (uint16_t)config->endpoints.size();
+                iface.num_endpoints = alt.bNumEndpoints;
+                config->interfaces.push_back(iface);
+
+                for (uint8_t k = 0; k < alt.bNumEndpoints; k++) {
+                    auto& desc = alt.endpoint[k];
+
+                    endpoint_info ep;
+                    ep.address = desc.bEndpointAddress;
+                    ep.interface_number = alt.bInterfaceNumber;
+                    ep.alt_setting = alt.bAlternateSetting;
+                    ep.transfer_type = (enum transfer_type)(desc.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK);
+                    ep.direction = (desc.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ? direction::IN : direction::OUT;
+                    ep.max_packet_size = desc.wMaxPacketSize & 0x7FF;
+                    ep.mult = (desc.wMaxPacketSize >> 11) & 0x03;     // High-bandwidth high-speed endpoints
+                    ep.interval = desc.bInterval;
+
+                    if (config->speed >= speed::SUPER) {
+                        libusb_ss_endpoint_companion_descriptor* companion = nullptr;
+                        if (libusb_get_ss_endpoint_companion_descriptor(context, &desc, &companion) == LIBUSB_SUCCESS) {
+                            ep.max_burst = companion->bMaxBurst;
+                            ep.bytes_per_interval = companion->wBytesPerInterval;
+                            if (ep.transfer_type == transfer_type::ISOCHRONOUS) {
+                                ep.mult = companion->bmAttributes & 0x03;
+                            }
+                            libusb_free_ss_endpoint_companion_descriptor(companion);
+                        }
+                    }
+                    config->endpoints.push_back(ep);
+                }
+            }
+        }
+
+        libusb_free_config_descriptor(descriptor);
+        return *config;
+    }
+
+    LIBUSBCPP_API const interface_info* basic_device::find_interface(uint8_t interface_class) {
+        for (auto& iface : configuration().interfaces) {
+            if (iface.interface_class == interface_class)
+                return &iface;
+        }
+        return nullptr;
+    }
+
+    LIBUSBCPP_API const endpoint_info* basic_device::find_endpoint(uint8_t address) {
+        for (auto& ep : configuration().endpoints) {
+            if (ep.address == address)
+                return &ep;
+        }
+        return nullptr;
+    }
+
+    LIBUSBCPP_API const endpoint_info* basic_device::find_endpoint(enum transfer_type type, enum direction direction,
+                                                                   std::optional<uint8_t> interface_class) {
+        auto& cfg = configuration();
+        for (auto& iface : cfg.interfaces) {
+            if (interface_class && iface.interface_class != *interface_class)
+                continue;
+
+            for (size_t i = iface.first_endpoint; i < iface.first_endpoint + iface.num_endpoints; i++) {
+                auto& ep = cfg.endpoints[i];
+                if (ep.transfer_type == type && ep.direction == direction)
+                    return &ep;
+            }
+        }
+        return nullptr;
+    }
+
+    LIBUSBCPP_API size_t basic_device::recommended_buffer_size(uint8_t address) {
+        const endpoint_info* ep = find_endpoint(address);
+        if (!ep || ep->burst_size() == 0)
+            return LIBUSBCPP_DEFAULT_BUFFER_SIZE;
+
+        size_t burst = ep->burst_size();
+        if (ep->transfer_type != transfer_type::BULK)
+            return burst;   // Periodic endpoints deliver at most one burst per interval
+
+        // Bulk reads must be a multiple of the packet size, otherwise the last packet may overflow
+        return burst * std::max<size_t>(1, LIBUSBCPP_DEFAULT_BUFFER_SIZE / burst);
+    }
+
     LIBUSBCPP_API std::string basic_device::bulk_read(uint16_t endpoint, size_t max_buffer_size, uint32_t timeout) {
+        if (max_buffer_size == LIBUSBCPP_AUTO_BUFFER_SIZE) {
+            max_buffer_size = recommended_buffer_size(endpoint | LIBUSB_ENDPOINT_IN);
+        }
         std::string buffer(max_buffer_size, 0);     // Provide a string with zeros as a buffer
         size_t transferred = bulk_transfer(endpoint | LIBUSB_ENDPOINT_IN,
                                            reinterpret_cast<unsigned char *>(&buffer[0]),
@@ -109,6 +257,33 @@ namespace usb {
         return buffer;
     }
 
+    LIBUSBCPP_API std::pmr::string basic_device::bulk_read_pmr(uint16_t endpoint, std::pmr::memory_resource* _resource,
+                                                               size_t max_buffer_size, uint32_t timeout) {
+        if (max_buffer_size == LIBUSBCPP_AUTO_BUFFER_SIZE) {
+            max_buffer_size = recommended_buffer_size(endpoint | LIBUSB_ENDPOINT_IN);
+        }
+
+        std::pmr::string buffer(max_buffer_size, 0, _resource);
+        size_t transferred = bulk_transfer(endpoint | LIBUSB_ENDPOINT_IN,
+                                           reinterpret_cast<unsigned char *>(&buffer[0]),
+                                           buffer.size(), timeout);
+        if (transferred == (size_t)-1) {  // Error
+            return std::pmr::string(_resource);
+        }
+
+        buffer.resize(transferred);
+        return buffer;
+    }
+
+    LIBUSBCPP_API size_t basic_device::bulk_read_into(uint16_t endpoint, uint8_t* buffer, size_t length,
+                                                      uint32_t timeout) {
+        size_t transferred = bulk_transfer(endpoint | LIBUSB_ENDPOINT_IN, buffer, length, timeout);
+        if (transferred == (size_t)-1) {  // Error
+            return 0;
+        }
+        return transferred;
+    }
+
     LIBUSBCPP_API size_t basic_device::bulk_write(std::vector<uint8_t> data, uint16_t endpoint, uint32_t timeout) {
         return bulk_write((uint8_t*)&data[0], data.size(), endpoint, timeout);
     }
@@ -135,6 +310,7 @@ namespace usb {
             return -1;
         }
 
+        TRACE_SPAN("bulk transfer", "transfer", "endpoint", endpoint);
         int transferred = 0;
         int status = libusb_bulk_transfer(handle, endpoint,buffer,
                                           (int)max_buffer_size, &transferred, timeout);
@@ -197,20 +373,167 @@ namespace usb {
 
 
 
+    LIBUSBCPP_API void scan_and_process_devices(
+            libusb_context* context, bool interface_classes,
+            const std::function<bool(device_info, libusb_device_handle*)>& callback);
+
+    LIBUSBCPP_API executor inline_executor() {
+        return [] (const std::function<void()>& task) { task(); };
+    }
+
+    LIBUSBCPP_API worker_executor::worker_executor() {
+        start(std::nullopt, "");
+    }
+
+    LIBUSBCPP_API worker_executor::worker_executor(const thread_config& config, const std::string& role) {
+        start(config, role);
+    }
+
+    void worker_executor::start(std::optional<thread_config> config, std::string role) {
+        thread = std::thread([this, config = std::move(config), role = std::move(role)] {
+            if (config) {
+                configure_this_thread(*config, role);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [this] { return terminate || !tasks.empty(); });
+                if (terminate)
+                    return;
+
+                auto task = std::move(tasks.front());
+                tasks.pop();
+                lock.unlock();
+                task();         // Run without holding the lock, so new tasks can be posted meanwhile
+                task = nullptr; // Release captured objects (e.g. devices) before locking again
+                lock.lock();
+            }
+        });
+    }
+
+    LIBUSBCPP_API worker_executor::~worker_executor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            terminate = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    LIBUSBCPP_API void worker_executor::post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    LIBUSBCPP_API worker_executor::operator executor() {
+        return [this] (std::function<void()> task) { post(std::move(task)); };
+    }
+
+    LIBUSBCPP_API void worker_executor::configure(const thread_config& config, const std::string& role) {
+        configure_thread(thread, config, role);
+    }
+
+    LIBUSBCPP_API bool hotplug_filter::matches(const device_properties& info) const {
+        if (vendor_id && *vendor_id != info.vendor_id)
+            return false;
+        if (product_id && *product_id != info.product_id)
+            return false;
+        if (device_class && *device_class != info.device_class)
+            return false;
+        if (interface_class && !info.interface_classes.test(*interface_class))
+            return false;
+        return true;
+    }
+
+    static uint32_t make_usb_id(uint16_t vendor_id, uint16_t product_id) {
+        return ((uint32_t)vendor_id << 16) | product_id;
+    }
+
+
+
+
+
+
     LIBUSBCPP_API generic_hotplug_handler::generic_hotplug_handler(opt_context context, int interval)
       : context(context), interval(interval) {
 
     }
 
-    LIBUSBCPP_API void generic_hotplug_handler::register_device_callback(const std::function<void(usb::device)>& _callback) {
-        register_device_callback(-1, -1, _callback);
+    LIBUSBCPP_API hotplug_callback_id generic_hotplug_handler::register_device_callback(
+            const std::function<void(usb::device)>& _callback) {
+        return register_device_callback(hotplug_filter(), _callback);
     }
 
-    LIBUSBCPP_API void generic_hotplug_handler::register_device_callback(
+    LIBUSBCPP_API hotplug_callback_id generic_hotplug_handler::register_device_callback(
             uint16_t vendor_id, uint16_t product_id, const std::function<void(usb::device)>& _callback) {
-        this->callback = _callback;
-        this->callback_vid = vendor_id;
-        this->callback_pid = product_id;
+        hotplug_filter filter;
+        filter.vendor_id = vendor_id;
+        filter.product_id = product_id;
+        filter.notify_known_devices = true;     // A specific usb id always opens every available device
+        return register_device_callback(filter, _callback);
+    }
+
+    LIBUSBCPP_API hotplug_callback_id generic_hotplug_handler::register_device_callback(
+            const hotplug_filter& filter, const std::function<void(usb::device)>& _callback) {
+        return add_registration({ filter, _callback, nullptr, std::make_shared<std::atomic<bool>>(true) });
+    }
+
+    LIBUSBCPP_API hotplug_callback_id generic_hotplug_handler::register_removal_callback(
+            const hotplug_filter& filter, const std::function<void(const device_info&)>& _callback) {
+        return add_registration({ filter, nullptr, _callback, std::make_shared<std::atomic<bool>>(true) });
+    }
+
+    LIBUSBCPP_API hotplug_callback_id generic_hotplug_handler::add_registration(registration reg) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        auto next = std::make_shared<registry>(*_registry);
+
+        hotplug_callback_id id = next_id++;
+        if (reg.filter.vendor_id && reg.filter.product_id) {
+            next->id_index[make_usb_id(*reg.filter.vendor_id, *reg.filter.product_id)].push_back(id);
+        }
+        else {
+            next->wildcard_index.push_back(id);
+        }
+        next->needs_interface_classes |= reg.filter.interface_class.has_value();
+        next->registrations.emplace(id, std::move(reg));
+        _registry = std::move(next);
+        return id;
+    }
+
+    LIBUSBCPP_API void generic_hotplug_handler::unregister_callback(hotplug_callback_id id) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+
+        auto it = _registry->registrations.find(id);
+        if (it == _registry->registrations.end())
+            return;
+        *it->second.alive = false;      // Shared with all tasks that are still queued
+
+        auto next = std::make_shared<registry>(*_registry);
+        auto& filter = it->second.filter;
+        std::vector<hotplug_callback_id>* index = &next->wildcard_index;
+        auto bucket = next->id_index.end();
+        if (filter.vendor_id && filter.product_id) {
+            bucket = next->id_index.find(make_usb_id(*filter.vendor_id, *filter.product_id));
+            index = &bucket->second;
+        }
+        index->erase(std::remove(index->begin(), index->end(), id), index->end());
+        if (bucket != next->id_index.end() && bucket->second.empty()) {
+            next->id_index.erase(bucket);
+        }
+        next->registrations.erase(id);
+        next->needs_interface_classes = std::any_of(next->registrations.begin(), next->registrations.end(),
+                                                    [] (const auto& entry) { return entry.second.filter.interface_class.has_value(); });
+        _registry = std::move(next);
+    }
+
+    LIBUSBCPP_API void generic_hotplug_handler::set_executor(executor executor) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        dispatch = executor ? std::move(executor) : inline_executor();
     }
 
     LIBUSBCPP_API void generic_hotplug_handler::update() {
@@ -223,70 +546,139 @@ namespace usb {
         update_devices();   // Only update in the specified interval
     }
 
-    LIBUSBCPP_API void generic_hotplug_handler::update_devices() {
-
-        if (!callback)  // If no callback, don't do anything
-            return;
+    LIBUSBCPP_API void generic_hotplug_handler::rescan() {
+        last_update = std::chrono::high_resolution_clock::now();
+        update_devices();
+    }
 
-        // Scan for new devices
-        auto devices_found = scan_devices(context);
-
-        // If usb id is specified, immediately open device no matter what (just try to open the device)
-        if (callback_vid != (uint16_t)-1 || callback_pid != (uint16_t)-1) {
-            for (auto& dev : devices_found) {
-                if (dev.vendor_id == callback_vid && dev.product_id == callback_pid) {  // Our usb id exists
-                    if (dev.state != state::IN_USE_OR_UNSUPPORTED) {    // Not if it is already in use
-                        // So, a device with our usb id exists, which is not yet in use
-                        usb::device device = find_first_device(dev.vendor_id, dev.product_id, context);
-                        if (device) {
-                            callback(device);
-                        }
-                    }
-                }
+    LIBUSBCPP_API void generic_hotplug_handler::collect_matches(const registry& snapshot, const device_info& info,
+                                                                bool is_new, bool removal,
+                                                                std::vector<hotplug_callback_id>& matches) {
+        auto check = [&] (hotplug_callback_id id) {
+            auto& reg = snapshot.registrations.at(id);
+            if (removal ? !reg.removal_callback : !reg.device_callback)
+                return;
+            if (!removal && !is_new && !reg.filter.notify_known_devices)
+                return;
+            if (reg.filter.matches(info)) {
+                matches.push_back(id);
             }
-            return;
+        };
+
+        auto bucket = snapshot.id_index.find(make_usb_id(info.vendor_id, info.product_id));
+        if (bucket != snapshot.id_index.end()) {
+            for (auto id : bucket->second) check(id);
         }
+        for (auto id : snapshot.wildcard_index) check(id);
+    }
 
-        // Otherwise, uo usb id is specified, only handle callback for a device we do not know yet
+    LIBUSBCPP_API void generic_hotplug_handler::update_devices() {
+        TRACE_SPAN("hotplug update", "hotplug");
+        std::lock_guard<std::mutex> update_lock(update_mutex);
+
+        // Only the snapshot is taken under the lock, callbacks can be registered while the bus is scanned
+        std::shared_ptr<const registry> snapshot;
+        executor _dispatch;
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            snapshot = _registry;
+            _dispatch = dispatch;
+        }
+        if (snapshot->registrations.empty())  // If no callback, don't do anything
+            return;
+
+        std::vector<std::function<void()>> tasks;
+        std::vector<device_info> devices_found;
 
-        // Check for new devices
-        std::vector<device_info> new_devices;
-        for (auto& info : devices_found) {
-            if(std::find(old_devices.begin(), old_devices.end(), info) == old_devices.end()) {
-                new_devices.emplace_back(info);
+        // A single pass over the bus: Every device is opened at most once and shared by all matching callbacks
+        std::vector<hotplug_callback_id> matches;
+        libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
+        scan_and_process_devices(_context, snapshot->needs_interface_classes,
+                                 [&] (const device_info& info, libusb_device_handle* handle) {
+            devices_found.emplace_back(info);
+            if (info.state != state::OPEN)     // Not if it is already in use or unsupported
+                return false;
+
+            bool is_new = std::none_of(old_devices.begin(), old_devices.end(),
+                                       [&] (const device_info& old) { return old.is_same_device(info); });
+            matches.clear();
+            collect_matches(*snapshot, info, is_new, false, matches);
+            if (matches.empty())
+                return false;
+
+            auto device = std::make_shared<usb::basic_device>(handle, info, _context);
+            for (auto id : matches) {
+                auto& reg = snapshot->registrations.at(id);
+                tasks.emplace_back([callback = reg.device_callback, alive = reg.alive, device] {
+                    if (*alive) callback(device);
+                });
             }
-        }
-        old_devices = devices_found;
+            return true;    // Keep it open, it belongs to the device object now
+        });
 
-        for (auto& dev : new_devices) {
-            if (dev.state != state::IN_USE_OR_UNSUPPORTED) {
-                usb::device device = find_first_device(dev.vendor_id, dev.product_id, context);
-                if (device) {
-                    callback(device);
-                }
+        // Check for removed devices
+        for (auto& old : old_devices) {
+            bool removed = std::none_of(devices_found.begin(), devices_found.end(),
+                                        [&] (const device_info& info) { return info.is_same_device(old); });
+            if (!removed)
+                continue;
+
+            matches.clear();
+            collect_matches(*snapshot, old, false, true, matches);
+            for (auto id : matches) {
+                auto& reg = snapshot->registrations.at(id);
+                tasks.emplace_back([callback = reg.removal_callback, alive = reg.alive, old] {
+                    if (*alive) callback(old);
+                });
             }
         }
+        old_devices = std::move(devices_found);
+
+        // Callbacks may register or unregister callbacks themselves, the registry is not locked here
+        for (auto& task : tasks) {
+            _dispatch(std::move(task));
+        }
     }
 
 
 
 
     LIBUSBCPP_API hotplug_handler::hotplug_handler(opt_context context, int interval)
-        : handler(context, interval), interval(interval) {
-
+        : interval(interval), threads(context.has_value() ? context->get().threads() : thread_config()),
+          dispatcher(threads, "dispatch"), handler(context, interval) {
+        handler.set_executor(dispatcher);
     }
 
     LIBUSBCPP_API hotplug_handler::~hotplug_handler() {
         stop_async();
     }
 
-    LIBUSBCPP_API void hotplug_handler::register_device_callback(const std::function<void(usb::device)>& callback) {
-        handler.register_device_callback(callback);
+    LIBUSBCPP_API hotplug_callback_id hotplug_handler::register_device_callback(
+            const std::function<void(usb::device)>& callback) {
+        return handler.register_device_callback(callback);
+    }
+
+    LIBUSBCPP_API hotplug_callback_id hotplug_handler::register_device_callback(
+            uint16_t vendor_id, uint16_t product_id, const std::function<void(usb::device)>& callback) {
+        return handler.register_device_callback(vendor_id, product_id, callback);
+    }
+
+    LIBUSBCPP_API hotplug_callback_id hotplug_handler::register_device_callback(
+            const hotplug_filter& filter, const std::function<void(usb::device)>& callback) {
+        return handler.register_device_callback(filter, callback);
+    }
+
+    LIBUSBCPP_API hotplug_callback_id hotplug_handler::register_removal_callback(
+            const hotplug_filter& filter, const std::function<void(const device_info&)>& callback) {
+        return handler.register_removal_callback(filter, callback);
+    }
+
+    LIBUSBCPP_API void hotplug_handler::unregister_callback(hotplug_callback_id id) {
+        handler.unregister_callback(id);
     }
 
-    LIBUSBCPP_API void hotplug_handler::register_device_callback(uint16_t vendor_id, uint16_t product_id,
-                                                                 const std::function<void(usb::device)>& callback) {
-        handler.register_device_callback(vendor_id, product_id, callback);
+    LIBUSBCPP_API void hotplug_handler::set_executor(executor executor) {
+        handler.set_executor(executor ? std::move(executor) : (usb::executor)dispatcher);
     }
 
     LIBUSBCPP_API void hotplug_handler::update() {
@@ -294,22 +686,78 @@ namespace usb {
     }
 
     LIBUSBCPP_API void hotplug_handler::run_async() {
+        if (thread.joinable())
+            return;
+
+        std::lock_guard<std::mutex> start_lock(mutex);  // set_thread_config() waits until the thread exists
         terminate = false;
-        thread = std::thread([&] {
-            while (!terminate) {
-                handler.update();
-                std::this_thread::sleep_for(std::chrono::milliseconds(interval / 10));
+        rescan_requested = true;    // Always scan once right away
+        thread = std::thread([this, config = threads] {
+            configure_this_thread(config, "hotplug");
+
+            auto wakeup = [this] { return terminate || rescan_requested; };
+            auto next_scan = std::chrono::steady_clock::now();
+
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                if (interval > 0) {
+                    if (!cv.wait_until(lock, next_scan, wakeup)) {
+                        _jitter.add(std::chrono::steady_clock::now() - next_scan);  // Woken up by the deadline
+                    }
+                }
+                else {
+                    cv.wait(lock, wakeup);
+                }
+                if (terminate)
+                    return;
+
+                rescan_requested = false;
+                lock.unlock();
+                handler.rescan();
+                lock.lock();
+                next_scan = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval);
             }
         });
     }
 
     LIBUSBCPP_API void hotplug_handler::stop_async() {
         if (thread.joinable()) {
-            terminate = true;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                terminate = true;
+            }
+            cv.notify_all();
             thread.join();
         }
     }
 
+    LIBUSBCPP_API void hotplug_handler::rescan_now() {
+        if (!thread.joinable()) {
+            handler.rescan();
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            rescan_requested = true;
+        }
+        cv.notify_all();
+    }
+
+    LIBUSBCPP_API void hotplug_handler::set_thread_config(const thread_config& config) {
+        std::lock_guard<std::mutex> lock(mutex);
+        threads = config;
+        dispatcher.configure(threads, "dispatch");
+        if (thread.joinable()) {
+            configure_thread(thread, threads, "hotplug");
+        }
+    }
+
+    LIBUSBCPP_API wakeup_jitter hotplug_handler::jitter() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return _jitter;
+    }
+
 
 
 
@@ -319,10 +767,97 @@ namespace usb {
 
 
 
-    LIBUSBCPP_API void scan_and_process_devices(
-                libusb_context* context, const std::function<bool(device_info, libusb_device_handle*)>& callback) {
-        static std::mutex mutex;
-        std::unique_lock<std::mutex> lock(mutex);
+    static std::mutex scan_mutex;
+
+    // Fills everything that is known without opening the device. Interface classes need the configuration
+    // descriptor, which costs a control transfer on some platforms, so it can be skipped.
+    template<typename Info>
+    static void read_device_properties(libusb_device* device, const libusb_device_descriptor& descriptor, Info& info,
+                                       bool interface_classes = true) {
+        static_cast<device_properties&>(info) = device_properties();
+        info.vendor_id = descriptor.idVendor;
+        info.product_id = descriptor.idProduct;
+        info.device_class = descriptor.bDeviceClass;
+        info.bus_number = libusb_get_bus_number(device);
+        info.device_address = libusb_get_device_address(device);
+
+        int ports = libusb_get_port_numbers(device, info.port_numbers.data(), (int)info.port_numbers.size());
+        info.port_depth = ports > 0 ? (uint8_t)ports : 0;
+
+        libusb_config_descriptor* config = nullptr;     // Does not require the device to be opened
+        if (interface_classes && libusb_get_active_config_descriptor(device, &config) == LIBUSB_SUCCESS) {
+            for (uint8_t j = 0; j < config->bNumInterfaces; j++) {
+                for (int k = 0; k < config->interface[j].num_altsetting; k++) {
+                    info.interface_classes.set(config->interface[j].altsetting[k].bInterfaceClass);
+                }
+            }
+            libusb_free_config_descriptor(config);
+        }
+    }
+
+    template<typename Info>
+    static void read_description(libusb_device_handle* device_handle, const libusb_device_descriptor& descriptor,
+                                 Info& info) {
+        TRACE_SPAN("string descriptors", "scan");
+        unsigned char buffer[1024];
+        int status = libusb_get_string_descriptor_ascii(device_handle, descriptor.iProduct,
+                                                        buffer, sizeof(buffer));
+        if (status < 0) {
+            LOG_ERROR("Reading string descriptor for device vid=0x%04X pid=0x%04X failed: %s",
+                      descriptor.idVendor, descriptor.idProduct, libusb_strerror(status));
+        }
+
+        if (status >= 0) {
+            info.description.assign((char*)buffer);
+        }
+        else {
+            info.description.clear();
+        }
+        info.state = usb::state::OPEN;
+    }
+
+    // Opens the device and reads its description. Returns nullptr if it cannot be opened, info.state tells why.
+    template<typename Info>
+    static libusb_device_handle* open_device(libusb_device* device, const libusb_device_descriptor& descriptor, Info& info) {
+        TRACE_SPAN("open device", "scan", "usb_id", (uint64_t)descriptor.idVendor << 16 | descriptor.idProduct);
+        libusb_device_handle* device_handle = nullptr;
+        int status = libusb_open(device, &device_handle);
+        if (status != LIBUSB_SUCCESS) {
+            LOG_ERROR("Opening device vid=0x%04X pid=0x%04X failed: (%d) %s",
+                      descriptor.idVendor, descriptor.idProduct, status, libusb_strerror(status));
+
+            // Opening failed, this usually means the libusb driver is not valid
+            // Zadig utility can be used to fix it
+            info.description.clear();
+
+            if (status == LIBUSB_ERROR_NOT_SUPPORTED) {
+                info.state = usb::state::IN_USE_OR_UNSUPPORTED;
+            }
+            else if (status == LIBUSB_ERROR_NOT_FOUND) {
+                info.state = usb::state::INVALID_DRIVER;
+            }
+            else {
+                info.state = usb::state::OTHER_LIBUSB_ERROR;
+            }
+            return nullptr;
+        }
+
+        read_description(device_handle, descriptor, info);
+        return device_handle;
+    }
+
+    static bool accept_all(const libusb_device_descriptor&) {
+        return true;
+    }
+
+    // Calls the callback for every device on the bus, it returns true to keep the device handle open.
+    // Devices rejected by the filter are skipped before they are opened.
+    // The same info object is filled for every device, so its description keeps its capacity between devices.
+    template<typename Info, typename Filter, typename Callback>
+    static void process_devices(libusb_context* context, Info& info, Filter&& filter, Callback&& callback,
+                                bool interface_classes = true) {
+        TRACE_SPAN("scan devices", "scan");     // Includes waiting for other scans
+        std::unique_lock<std::mutex> lock(scan_mutex);
 
         libusb_device** device_list;
         ssize_t device_count = libusb_get_device_list(context, &device_list);
@@ -331,7 +866,7 @@ namespace usb {
             return;
         }
 
-        for (size_t i = 0; i < device_count; i++) {
+        for (ssize_t i = 0; i < device_count; i++) {
 
             struct libusb_device_descriptor descriptor{};
             int status = libusb_get_device_descriptor(device_list[i], &descriptor);
@@ -340,49 +875,14 @@ namespace usb {
                 continue;   // Jump back to top
             }
 
-            // Open the device temporarily
-            libusb_device_handle* device_handle = nullptr;
-            status = libusb_open(device_list[i], &device_handle);
-            if (status != LIBUSB_SUCCESS) {
-                LOG_ERROR("Opening device vid=0x%04X pid=0x%04X failed: (%d) %s",
-                          descriptor.idVendor, descriptor.idProduct, status, libusb_strerror(status));
-
-                device_info info;       // Opening failed, this usually means the libusb driver is not valid
-                info.vendor_id = descriptor.idVendor;           // Zadig utility can be used to fix it
-                info.product_id = descriptor.idProduct;
-                info.description = "";
-
-                if (status == LIBUSB_ERROR_NOT_SUPPORTED) {
-                    info.state = usb::state::IN_USE_OR_UNSUPPORTED;
-                    callback(info, nullptr);
-                }
-                else if (status == LIBUSB_ERROR_NOT_FOUND) {
-                    info.state = usb::state::INVALID_DRIVER;
-                    callback(info, nullptr);
-                }
-                else {
-                    info.state = usb::state::OTHER_LIBUSB_ERROR;
-                    callback(info, nullptr);
-                }
+            if (!filter(descriptor))
+                continue;
 
-                continue;   // Jump back to top
-            }
+            read_device_properties(device_list[i], descriptor, info, interface_classes);
 
-            unsigned char buffer[1024];
-            status = libusb_get_string_descriptor_ascii(device_handle, descriptor.iProduct,
-                                                        buffer, sizeof(buffer));
-            if (status < 0) {
-                LOG_ERROR("Reading string descriptor for device vid=0x%04X pid=0x%04X failed: %s",
-                          descriptor.idVendor, descriptor.idProduct, libusb_strerror(status));
-            }
-
-            device_info info;
-            info.vendor_id = descriptor.idVendor;
-            info.product_id = descriptor.idProduct;
-            info.description = status >= 0 ? std::string((char*)buffer) : "";
-            info.state = usb::state::OPEN;
-
-            if (!callback(info, device_handle)) {
+            // Open the device temporarily
+            libusb_device_handle* device_handle = open_device(device_list[i], descriptor, info);
+            if (!callback(info, device_handle) && device_handle) {
                 libusb_close(device_handle);
             }
         }
@@ -390,11 +890,18 @@ namespace usb {
         libusb_free_device_list(device_list, 1);
     }
 
+    LIBUSBCPP_API void scan_and_process_devices(
+                libusb_context* context, bool interface_classes,
+                const std::function<bool(device_info, libusb_device_handle*)>& callback) {
+        device_info info;
+        process_devices(context, info, accept_all, callback, interface_classes);
+    }
+
     LIBUSBCPP_API std::vector<device_info> scan_devices(opt_context context) {
         std::vector<device_info> device_list;
 
         libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
-        scan_and_process_devices(_context, [&] (const struct device_info& info, libusb_device_handle*) {
+        scan_and_process_devices(_context, true, [&] (const struct device_info& info, libusb_device_handle*) {
             device_list.emplace_back(info);
             return false;       // Do not keep the device open
         });
@@ -402,18 +909,72 @@ namespace usb {
         return device_list;
     }
 
+    LIBUSBCPP_API std::vector<device_properties> list_devices(opt_context context) {
+        std::vector<device_properties> devices;
+        libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
+
+        libusb_device** device_list;
+        ssize_t device_count = libusb_get_device_list(_context, &device_list);
+        if (device_count < 0) {
+            LOG_ERROR("Cannot list devices, libusb_get_device_list failed: %s", libusb_strerror(device_count));
+            return devices;
+        }
+
+        for (ssize_t i = 0; i < device_count; i++) {
+            struct libusb_device_descriptor descriptor{};
+            if (libusb_get_device_descriptor(device_list[i], &descriptor) != LIBUSB_SUCCESS)
+                continue;
+            read_device_properties(device_list[i], descriptor, devices.emplace_back());
+        }
+
+        libusb_free_device_list(device_list, 1);
+        return devices;
+    }
+
+    // Opens every device the filter accepts in a single pass over the bus, without the device cache.
+    // Not part of the public API, the context pool opens the devices of each shard with it.
+    LIBUSBCPP_API std::vector<usb::device> open_devices(libusb_context* context,
+                                                        const std::function<bool(const device_properties&)>& filter) {
+        std::vector<usb::device> devices;
+        std::unique_lock<std::mutex> lock(scan_mutex);
+
+        libusb_device** device_list;
+        ssize_t device_count = libusb_get_device_list(context, &device_list);
+        if (device_count < 0) {
+            LOG_ERROR("Cannot open devices, libusb_get_device_list failed: %s", libusb_strerror(device_count));
+            return devices;
+        }
+
+        device_info info;
+        for (ssize_t i = 0; i < device_count; i++) {
+            struct libusb_device_descriptor descriptor{};
+            if (libusb_get_device_descriptor(device_list[i], &descriptor) != LIBUSB_SUCCESS)
+                continue;
+
+            read_device_properties(device_list[i], descriptor, info);
+            if (!filter(info))
+                continue;
+
+            if (libusb_device_handle* handle = open_device(device_list[i], descriptor, info)) {
+                devices.emplace_back(std::make_shared<usb::basic_device>(handle, info, context));
+            }
+        }
+
+        libusb_free_device_list(device_list, 1);
+        return devices;
+    }
+
     LIBUSBCPP_API std::vector<usb::device> find_devices(uint16_t vendor_id, uint16_t product_id, opt_context context) {
         std::vector<usb::device> devices;
+        device_info info;
 
-        // Following function calls the callback for every entry
+        // Only devices with the correct id are opened at all
         libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
-        scan_and_process_devices(_context,
-                                 [&] (const struct device_info& info, libusb_device_handle* handle){
-            if (info.vendor_id == vendor_id && info.product_id == product_id) { // Correct device id
-                devices.emplace_back(std::make_shared<usb::basic_device>(handle, info));
-                return true;    // Keep it open if it is valid
-            }
-            return false;   // Wrong device
+        process_devices(_context, info, [&] (const libusb_device_descriptor& descriptor) {
+            return descriptor.idVendor == vendor_id && descriptor.idProduct == product_id;
+        }, [&] (const struct device_info& info, libusb_device_handle* handle) {
+            devices.emplace_back(std::make_shared<usb::basic_device>(handle, info, _context));
+            return true;    // Keep it open if it is valid
         });
 
         return devices;
@@ -431,10 +992,256 @@ namespace usb {
     }
 
     LIBUSBCPP_API usb::device find_first_device(uint16_t vendor_id, uint16_t product_id, opt_context context) {
-        auto devices = find_valid_devices(vendor_id, product_id, context);
-        for (auto& device : devices) {
-            return device;
+        usb::device device;
+        device_info info;
+
+        // Stops opening devices as soon as one could be opened
+        libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
+        process_devices(_context, info, [&] (const libusb_device_descriptor& descriptor) {
+            return !device && descriptor.idVendor == vendor_id && descriptor.idProduct == product_id;
+        }, [&] (const struct device_info& info, libusb_device_handle* handle) {
+            if (!handle)
+                return false;
+            device = std::make_shared<usb::basic_device>(handle, info, _context);
+            return true;
+        });
+
+        return device;
+    }
+
+
+
+
+
+    // Devices found by port path or serial number, so they can be reopened without enumerating the bus.
+    // Every entry holds a reference on its libusb_device.
+    struct cached_device {
+        libusb_device* device = nullptr;
+        device_info info;
+    };
+    static std::mutex device_cache_mutex;
+    static std::map<std::pair<libusb_context*, std::string>, cached_device> device_cache;
+
+    static usb::device open_cached_device(libusb_context* context, const std::string& key) {
+        std::lock_guard<std::mutex> lock(device_cache_mutex);
+
+        auto it = device_cache.find({ context, key });
+        if (it == device_cache.end())
+            return nullptr;
+
+        auto& cached = it->second;
+        libusb_device_handle* handle = nullptr;
+        int status = libusb_open(cached.device, &handle);
+        if (status == LIBUSB_SUCCESS) {
+            return std::make_shared<usb::basic_device>(handle, cached.info, context);
         }
+
+        // The device is gone (or unusable), forget it
+        LOG_DEBUG("Reopening cached device %s failed: %s", key.c_str(), libusb_strerror(status));
+        libusb_unref_device(cached.device);
+        device_cache.erase(it);
         return nullptr;
     }
+
+    static void cache_device(libusb_context* context, const std::string& key, libusb_device* device,
+                             const device_info& info) {
+        std::lock_guard<std::mutex> lock(device_cache_mutex);
+
+        auto& entry = device_cache[{ context, key }];
+        if (entry.device) {
+            libusb_unref_device(entry.device);
+        }
+        entry.device = libusb_ref_device(device);
+        entry.info = info;
+    }
+
+    static void clear_device_cache(libusb_context* context) {
+        std::lock_guard<std::mutex> lock(device_cache_mutex);
+
+        for (auto it = device_cache.begin(); it != device_cache.end();) {
+            if (it->first.first == context) {
+                libusb_unref_device(it->second.device);
+                it = device_cache.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    // Parses "<bus>-<port>.<port>...", e.g. "1-4.2"
+    static bool parse_port_path(const std::string& path, uint8_t& bus, std::vector<uint8_t>& ports) {
+        char* end = nullptr;
+        unsigned long value = strtoul(path.c_str(), &end, 10);
+        if (end == path.c_str() || *end != '-' || value > 255)
+            return false;
+        bus = (uint8_t)value;
+
+        ports.clear();
+        do {
+            const char* start = end + 1;
+            value = strtoul(start, &end, 10);
+            if (end == start || value > 255)
+                return false;
+            ports.push_back((uint8_t)value);
+        } while (*end == '.');
+
+        return *end == '\0';
+    }
+
+    // The predicate opens the device it is looking for and returns the handle, nullptr for all others
+    template<typename Predicate>
+    static usb::device open_uncached_device(libusb_context* context, const std::string& key, Predicate&& predicate) {
+        std::unique_lock<std::mutex> lock(scan_mutex);
+
+        libusb_device** device_list;
+        ssize_t device_count = libusb_get_device_list(context, &device_list);
+        if (device_count < 0) {
+            LOG_ERROR("Cannot scan devices, libusb_get_device_list failed: %s", libusb_strerror(device_count));
+            return nullptr;
+        }
+
+        usb::device device;
+        for (ssize_t i = 0; i < device_count && !device; i++) {
+            struct libusb_device_descriptor descriptor{};
+            if (libusb_get_device_descriptor(device_list[i], &descriptor) != LIBUSB_SUCCESS)
+                continue;
+
+            libusb_device_handle* handle = predicate(device_list[i], descriptor);
+            if (!handle)
+                continue;
+
+            device_info info;
+            read_device_properties(device_list[i], descriptor, info);
+            read_description(handle, descriptor, info);
+            device = std::make_shared<usb::basic_device>(handle, info, context);
+            cache_device(context, key, device_list[i], info);
+        }
+
+        libusb_free_device_list(device_list, 1);
+        return device;
+    }
+
+    LIBUSBCPP_API std::string device_properties::port_path() const {
+        std::string path = std::to_string(bus_number) + "-";
+        for (uint8_t i = 0; i < port_depth; i++) {
+            path += (i > 0 ? "." : "") + std::to_string(port_numbers[i]);
+        }
+        return path;
+    }
+
+    LIBUSBCPP_API usb::device open_device_by_path(const std::string& port_path, opt_context context) {
+        libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
+        std::string key = "path:" + port_path;
+        if (auto device = open_cached_device(_context, key))
+            return device;
+
+        uint8_t bus = 0;
+        std::vector<uint8_t> ports;
+        if (!parse_port_path(port_path, bus, ports)) {
+            LOG_ERROR("Invalid port path '%s', expected e.g. '1-4.2'", port_path.c_str());
+            return nullptr;
+        }
+
+        // Only the device on this port is opened
+        return open_uncached_device(_context, key, [&] (libusb_device* device, const libusb_device_descriptor&) {
+            uint8_t numbers[7];
+            int count = libusb_get_port_numbers(device, numbers, sizeof(numbers));
+            if (libusb_get_bus_number(device) != bus || count != (int)ports.size()
+                    || !std::equal(ports.begin(), ports.end(), numbers))
+                return (libusb_device_handle*)nullptr;
+
+            libusb_device_handle* handle = nullptr;
+            int status = libusb_open(device, &handle);
+            if (status != LIBUSB_SUCCESS) {
+                LOG_ERROR("Opening device at %s failed: %s", port_path.c_str(), libusb_strerror(status));
+                return (libusb_device_handle*)nullptr;
+            }
+            return handle;
+        });
+    }
+
+    LIBUSBCPP_API usb::device open_device_by_serial(const std::string& serial, opt_context context) {
+        return open_device_by_serial(serial, -1, -1, context);
+    }
+
+    LIBUSBCPP_API usb::device open_device_by_serial(const std::string& serial, uint16_t vendor_id, uint16_t product_id,
+                                                    opt_context context) {
+        libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
+        std::string key = "serial:" + std::to_string(vendor_id) + ":" + std::to_string(product_id) + ":" + serial;
+        if (auto device = open_cached_device(_context, key))
+            return device;
+
+        // The serial number can only be read from an open device, the usb id narrows down the candidates
+        bool any_id = vendor_id == (uint16_t)-1 && product_id == (uint16_t)-1;
+        return open_uncached_device(_context, key, [&] (libusb_device* device, const libusb_device_descriptor& descriptor) {
+            if (descriptor.iSerialNumber == 0)
+                return (libusb_device_handle*)nullptr;
+            if (!any_id && (descriptor.idVendor != vendor_id || descriptor.idProduct != product_id))
+                return (libusb_device_handle*)nullptr;
+
+            libusb_device_handle* handle = nullptr;
+            if (libusb_open(device, &handle) != LIBUSB_SUCCESS)
+                return (libusb_device_handle*)nullptr;
+
+            unsigned char buffer[256];
+            int status = libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber, buffer, sizeof(buffer));
+            if (status < 0 || serial.compare(0, std::string::npos, (char*)buffer, status) != 0) {
+                libusb_close(handle);
+                return (libusb_device_handle*)nullptr;
+            }
+            return handle;
+        });
+    }
+
+    LIBUSBCPP_API void clear_device_cache(opt_context context) {
+        clear_device_cache(context.has_value() ? (libusb_context*)context.value().get() : nullptr);
+    }
+
+    namespace pmr {
+
+        LIBUSBCPP_API std::pmr::vector<device_info> scan_devices(std::pmr::memory_resource* resource, opt_context context) {
+            std::pmr::vector<device_info> devices(resource);
+            devices.resize(scan_devices(devices, context), device_info(resource));
+            return devices;
+        }
+
+        LIBUSBCPP_API size_t scan_devices(std::pmr::vector<device_info>& devices, opt_context context) {
+            device_info info(devices.get_allocator());
+            size_t count = 0;
+
+            libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
+            process_devices(_context, info, accept_all, [&] (const device_info& info, libusb_device_handle*) {
+                if (count < devices.size()) {
+                    devices[count] = info;      // Copy assignment keeps the allocated description
+                }
+                else {
+                    devices.push_back(info);
+                }
+                count++;
+                return false;       // Do not keep the device open
+            });
+
+            return count;   // Not resized, that would destroy the entries and their capacity
+        }
+
+        LIBUSBCPP_API std::pmr::vector<usb::device> find_devices(uint16_t vendor_id, uint16_t product_id,
+                                                                 std::pmr::memory_resource* resource, opt_context context) {
+            std::pmr::vector<usb::device> devices(resource);
+            std::pmr::polymorphic_allocator<basic_device> allocator(resource);
+            device_info info(resource);
+
+            libusb_context* _context = context.has_value() ? (libusb_context*)context.value().get() : nullptr;
+            process_devices(_context, info, [&] (const libusb_device_descriptor& descriptor) {
+                return descriptor.idVendor == vendor_id && descriptor.idProduct == product_id;
+            }, [&] (const device_info& info, libusb_device_handle* handle) {
+                devices.emplace_back(std::allocate_shared<usb::basic_device>(allocator, handle, info,
+                                                                             _context, resource));
+                return true;    // Keep it open if it is valid
+            });
+
+            return devices;
+        }
+
+    }
 }
@@ -0,0 +1,304 @@
+#include <utility>
+#include <cstring>
+#include "log.h"
+
+#define LIBUSBCPP_EXPORTS
+#include "libusbcpp_recorder.h"
+
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace usb {
+
+    LIBUSBCPP_API recorder::recorder(usb::device device, uint8_t endpoint, const std::string& path,
+                                     const recorder_config& config)
+        : device(std::move(device)), endpoint(endpoint), path(path), config(config) {
+
+        if (this->config.block_size == 0 || this->config.block_size % LIBUSBCPP_RECORDER_ALIGNMENT != 0) {
+            LOG_ERROR("Recorder block size must be a multiple of %d bytes", LIBUSBCPP_RECORDER_ALIGNMENT);
+            throw std::runtime_error("[libusbcpp]: Recorder block size must be a multiple of the alignment!");
+        }
+        this->config.block_count = std::max<size_t>(this->config.block_count, 2);
+    }
+
+    LIBUSBCPP_API recorder::~recorder() {
+        stop();
+        for (auto& b : blocks) {
+            ::operator delete(b.data, std::align_val_t(LIBUSBCPP_RECORDER_ALIGNMENT));
+        }
+    }
+
+    LIBUSBCPP_API bool recorder::start() {
+        if (usb_thread.joinable() || !device || !device->is_open())
+            return false;
+
+        if (!open_file())
+            return false;
+
+        if (blocks.empty()) {
+            for (size_t i = 0; i < config.block_count; i++) {
+                block b;
+                b.data = static_cast<uint8_t*>(::operator new(config.block_size,
+                                                              std::align_val_t(LIBUSBCPP_RECORDER_ALIGNMENT)));
+                blocks.push_back(b);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_blocks = {};
+            filled_blocks = {};
+            for (auto& b : blocks) {
+                free_blocks.push({ b.data, 0 });
+            }
+            current.reset();
+            stopping = false;
+            writer_done = false;
+            sequence = 0;
+            _stats = {};
+        }
+
+        start_time = std::chrono::steady_clock::now();
+        writer_thread = std::thread([this] {
+            configure_this_thread(config.threads, "rec-disk");
+            write_blocks();
+        });
+        usb_thread = std::thread([this] {
+            configure_this_thread(config.threads, "rec-usb");
+            device->stream_read(endpoint, [this] (const uint8_t* data, size_t length) {
+                return on_data(data, length);
+            }, config.stream);
+        });
+        return true;
+    }
+
+    LIBUSBCPP_API void recorder::stop() {
+        if (!usb_thread.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        usb_thread.join();      // The stream ends with the next completed transfer
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (current && current->used > 0) {
+                submit_current_block();
+            }
+            writer_done = true;
+        }
+        cv.notify_all();
+        writer_thread.join();
+        close_file();
+    }
+
+    LIBUSBCPP_API recorder_stats recorder::stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return _stats;
+    }
+
+    // Runs on the USB thread
+    LIBUSBCPP_API bool recorder::on_data(const uint8_t* data, size_t length) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stopping)
+            return false;
+        if (length == 0)
+            return true;    // Timeout without data
+
+        recorder_chunk_header header;
+        header.length = (uint32_t)length;
+        header.sequence = sequence++;
+        header.timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_time).count();
+
+        _stats.bytes_received += length;
+        if (free_blocks.size() < config.block_count / 2) {
+            _stats.backpressure_events++;
+        }
+
+        // Either the whole chunk fits into the free space, or it is dropped. A partial chunk would corrupt the file.
+        size_t needed = length + (config.chunk_headers ? sizeof(header) : 0);
+        size_t available = free_blocks.size() * config.block_size;
+        if (current) {
+            available += config.block_size - current->used;
+        }
+        if (needed > available) {
+            _stats.chunks_dropped++;
+            _stats.bytes_dropped += length;
+            return true;
+        }
+
+        if (config.chunk_headers) {
+            append(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+        }
+        append(data, length);
+        _stats.chunks_recorded++;
+
+        lock.unlock();
+        cv.notify_all();
+        return true;
+    }
+
+    // Must be called with the lock held, and only after making sure there is enough free space
+    LIBUSBCPP_API void recorder::append(const uint8_t* data, size_t length) {
+        while (length > 0) {
+            if (!current) {
+                current = free_blocks.front();
+                free_blocks.pop();
+                current->used = 0;
+            }
+
+            size_t count = std::min(length, config.block_size - current->used);
+            memcpy(current->data + current->used, data, count);
+            current->used += count;
+            data += count;
+            length -= count;
+
+            if (current->used == config.block_size) {
+                submit_current_block();
+            }
+        }
+    }
+
+    // Must be called with the lock held
+    LIBUSBCPP_API void recorder::submit_current_block() {
+        filled_blocks.push(*current);
+        current.reset();
+        _stats.max_queued_blocks = std::max(_stats.max_queued_blocks, filled_blocks.size());
+    }
+
+    // Runs on the writer thread
+    LIBUSBCPP_API void recorder::write_blocks() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // Called with the lock held, writes without it
+        auto write = [&] (const uint8_t* data, size_t length) {
+            lock.unlock();
+            auto begin = std::chrono::steady_clock::now();
+            size_t written = 0;
+#ifdef _WIN32
+            written = fwrite(data, 1, length, reinterpret_cast<std::FILE*>(file));
+#else
+    #ifdef O_DIRECT
+            if (direct_io && length % LIBUSBCPP_RECORDER_ALIGNMENT != 0) {
+                // Only the very last block can be partial, it cannot be written with direct I/O
+                fcntl((int)file, F_SETFL, fcntl((int)file, F_GETFL) & ~O_DIRECT);
+                direct_io = false;
+            }
+    #endif
+            while (written < length) {
+                ssize_t result = ::write((int)file, data + written, length - written);
+                if (result < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    LOG_ERROR("Recorder failed to write to '%s': %s", path.c_str(), strerror(errno));
+                    break;
+                }
+                written += (size_t)result;
+            }
+#endif
+            auto duration = std::chrono::steady_clock::now() - begin;
+
+            lock.lock();
+            _stats.bytes_written += written;
+            _stats.write_seconds += std::chrono::duration<double>(duration).count();
+        };
+
+        const uint8_t* flushed_block = nullptr;     // A periodic flush already wrote the start of this block
+        size_t flushed = 0;
+        auto next_flush = std::chrono::steady_clock::now() + config.flush_interval;
+        auto ready = [this] { return writer_done || !filled_blocks.empty(); };
+
+        while (true) {
+            if (config.flush_interval.count() <= 0) {
+                cv.wait(lock, ready);
+            }
+            else if (!cv.wait_until(lock, next_flush, ready)) {
+                // No block filled up in time: Write what the current block has so far. The USB thread only ever
+                // appends to it, the bytes before 'used' do not change anymore.
+                next_flush = std::chrono::steady_clock::now() + config.flush_interval;
+                if (!current)
+                    continue;
+
+                size_t begin = current->data == flushed_block ? flushed : 0;
+                size_t end = current->used;
+                if (direct_io) {
+                    end -= end % LIBUSBCPP_RECORDER_ALIGNMENT;
+                }
+                if (end <= begin)
+                    continue;
+
+                const uint8_t* data = current->data;
+                write(data + begin, end - begin);
+                flushed_block = data;
+                flushed = end;
+                continue;
+            }
+
+            if (filled_blocks.empty())
+                return;     // writer_done and everything is written
+
+            block b = filled_blocks.front();
+            filled_blocks.pop();
+
+            size_t begin = 0;
+            if (b.data == flushed_block) {
+                begin = flushed;
+                flushed_block = nullptr;
+            }
+            write(b.data + begin, b.used - begin);
+            free_blocks.push({ b.data, 0 });
+        }
+    }
+
+    LIBUSBCPP_API bool recorder::open_file() {
+#ifdef _WIN32
+        std::FILE* f = fopen(path.c_str(), "wb");
+        if (!f) {
+            LOG_ERROR("Recorder cannot open '%s'", path.c_str());
+            return false;
+        }
+        setvbuf(f, nullptr, _IONBF, 0);     // Blocks are already large, no need for another copy
+        file = reinterpret_cast<intptr_t>(f);
+        direct_io = false;
+#else
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        int fd = -1;
+        direct_io = false;
+    #ifdef O_DIRECT
+        if (config.direct_io) {
+            fd = open(path.c_str(), flags | O_DIRECT, 0644);
+            direct_io = fd >= 0;    // Not every file system supports it (e.g. tmpfs)
+        }
+    #endif
+        if (fd < 0) {
+            fd = open(path.c_str(), flags, 0644);
+        }
+        if (fd < 0) {
+            LOG_ERROR("Recorder cannot open '%s': %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        file = fd;
+#endif
+        return true;
+    }
+
+    LIBUSBCPP_API void recorder::close_file() {
+        if (file == -1)
+            return;
+#ifdef _WIN32
+        fclose(reinterpret_cast<std::FILE*>(file));
+#else
+        close((int)file);
+#endif
+        file = -1;
+    }
+
+}
@@ -0,0 +1,420 @@
+#include <utility>
+#include <algorithm>
+#include <deque>
+#include "libusb.h"
+#include "log.h"
+
+#define LIBUSBCPP_EXPORTS
+#include "libusbcpp.h"
+#include "trace.h"
+
+namespace usb {
+
+    using steady_clock = std::chrono::steady_clock;
+
+    struct stream_slot {
+        explicit stream_slot(std::pmr::memory_resource* resource) : buffer(resource) {}
+
+        libusb_transfer* transfer = nullptr;
+        std::pmr::vector<uint8_t> buffer;
+        steady_clock::time_point submitted;
+        bool in_flight = false;
+#ifdef LIBUSBCPP_TRACING
+        uint64_t trace_submitted = 0;   // [ns] trace::now(), 0 if tracing was inactive
+#endif
+
+        std::mutex* completed_mutex = nullptr;
+        std::condition_variable* completed_cv = nullptr;
+        std::pmr::vector<stream_slot*>* completed = nullptr;
+    };
+
+    // Called from whichever thread handles the libusb events, usually the one running the stream.
+    // With handle_events disabled the stream sleeps on the condition variable instead.
+    static void LIBUSB_CALL on_stream_transfer_complete(libusb_transfer* transfer) {
+        auto* slot = (stream_slot*)transfer->user_data;
+        TRACE_SPAN("complete", "transfer", "bytes", (uint64_t)transfer->actual_length);
+#ifdef LIBUSBCPP_TRACING
+        if (slot->trace_submitted != 0 && trace::active.load(std::memory_order_relaxed)) {
+            trace::record_async("in flight", "transfer", (uint64_t)(uintptr_t)slot, slot->trace_submitted, trace::now(),
+                                "bytes", (uint64_t)transfer->actual_length);
+        }
+#endif
+        std::lock_guard<std::mutex> lock(*slot->completed_mutex);
+        slot->completed->push_back(slot);
+        slot->completed_cv->notify_one();   // Under the lock, the stream may end as soon as it sees the slot
+    }
+
+    // Hill climbing: If the starting point exceeds the latency limit, the transfer size and then the queue depth are
+    // halved until it holds. Then the transfer size is doubled, then the queue depth, as long as every step improves
+    // the throughput noticeably and the memory and latency limits hold. Each step is measured over one window,
+    // a step that does not pay off is reverted and the search moves on to the next parameter.
+    class stream_tuner {
+    public:
+        stream_tuner(const stream_config& config, size_t transfer_size, int queue_depth, size_t min_transfer_size)
+            : config(config), min_transfer_size(min_transfer_size) {
+            current.transfer_size = transfer_size;
+            current.queue_depth = queue_depth;
+            current.settled = !config.auto_tune;
+            best = current;
+            measured = current;
+            window_start = steady_clock::now();
+        }
+
+        // In use right now. Throughput and latency stay 0 until these parameters have been measured.
+        const stream_parameters& parameters() const {
+            return current;
+        }
+
+        // The parameters measured in the last window, together with their own measurement
+        const stream_parameters& measurement() const {
+            return measured;
+        }
+
+        // Returns true when a window was measured and the parameters may have changed
+        bool on_completion(size_t bytes, steady_clock::time_point submitted, steady_clock::time_point now) {
+            if (submitted < window_start)
+                return false;   // Submitted with the previous parameters, it would distort the measurement
+
+            window_bytes += bytes;
+            window_latency += std::chrono::duration_cast<std::chrono::microseconds>(now - submitted);
+            window_count++;
+
+            auto elapsed = now - window_start;
+            if (window_count < (size_t)std::max(8, 2 * current.queue_depth) || elapsed < std::chrono::milliseconds(50))
+                return false;
+
+            current.throughput = (double)window_bytes / std::chrono::duration<double>(elapsed).count();
+            current.latency = window_latency / window_count;
+            measured = current;
+            reset_window(now);
+
+            if (current.settled)
+                return false;
+
+            if (phase == SHRINK) {
+                best = current;     // Nothing else was measured yet, the latency limit comes first
+                if (current.latency <= config.max_latency) {
+                    phase = TRANSFER_SIZE;
+                }
+            }
+            else if (current.latency <= config.max_latency && current.throughput > best.throughput * 1.05) {
+                best = current;     // The step paid off
+            }
+            else {
+                phase++;            // Revert and continue with the next parameter
+            }
+
+            propose_step();
+            if (current.settled) {
+                measured = current;
+            }
+            return true;
+        }
+
+        // A timed out transfer says the device had nothing to send, not how fast the bus is. The window starts over,
+        // the transfer is only resubmitted.
+        void on_timeout(steady_clock::time_point now) {
+            if (!current.settled) {
+                reset_window(now);
+            }
+        }
+
+    private:
+        enum { SHRINK, TRANSFER_SIZE, QUEUE_DEPTH, SETTLED };
+
+        void propose_step() {
+            current = best;
+            while (phase != SETTLED) {
+                if (phase == SHRINK) {
+                    if (best.transfer_size / 2 >= min_transfer_size) {
+                        current.transfer_size = best.transfer_size / 2;
+                        break;
+                    }
+                    if (best.queue_depth > 1) {
+                        current.queue_depth = best.queue_depth / 2;
+                        break;
+                    }
+                    LOG_WARN("Stream cannot reach the latency limit of %lld us",
+                             (long long)config.max_latency.count());
+                    phase = SETTLED;    // Growing would only make it worse
+                    break;
+                }
+                else if (phase == TRANSFER_SIZE) {
+                    size_t size = best.transfer_size * 2;
+                    if (size * best.queue_depth <= config.max_memory) {
+                        current.transfer_size = size;
+                        break;
+                    }
+                }
+                else if (phase == QUEUE_DEPTH) {
+                    int depth = best.queue_depth * 2;
+                    if (best.transfer_size * depth <= config.max_memory) {
+                        current.queue_depth = depth;
+                        break;
+                    }
+                }
+                phase++;
+            }
+
+            if (phase != SETTLED) {
+                current.throughput = 0;     // Not measured yet
+                current.latency = std::chrono::microseconds(0);
+                return;
+            }
+            current.settled = true;
+            LOG_DEBUG("Stream settled: %zu bytes x %d transfers, %.1f MB/s",
+                      current.transfer_size, current.queue_depth, current.throughput / 1e6);
+        }
+
+        void reset_window(steady_clock::time_point now) {
+            window_start = now;
+            window_bytes = 0;
+            window_latency = std::chrono::microseconds(0);
+            window_count = 0;
+        }
+
+        const stream_config& config;
+        size_t min_transfer_size;
+        stream_parameters current;
+        stream_parameters best;     // Last measured parameters that were accepted
+        stream_parameters measured;
+        int phase = SHRINK;
+
+        steady_clock::time_point window_start;
+        size_t window_bytes = 0;
+        std::chrono::microseconds window_latency { 0 };
+        size_t window_count = 0;
+    };
+
+
+
+
+
+    LIBUSBCPP_API stream_parameters basic_device::stream_read(uint8_t endpoint,
+                                                              const std::function<bool(const uint8_t*, size_t)>& callback,
+                                                              const stream_config& config) {
+        return stream(endpoint | LIBUSB_ENDPOINT_IN, config, callback, nullptr);
+    }
+
+    LIBUSBCPP_API stream_parameters basic_device::stream_write(uint8_t endpoint,
+                                                               const std::function<size_t(uint8_t*, size_t)>& callback,
+                                                               const stream_config& config) {
+        return stream(endpoint & ~LIBUSB_ENDPOINT_IN, config, nullptr, callback);
+    }
+
+    LIBUSBCPP_API void basic_device::on_stream_parameters(const std::function<void(const stream_parameters&)>& callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stream_parameters_callback = callback;
+    }
+
+    LIBUSBCPP_API stream_parameters basic_device::stream(uint8_t endpoint, const stream_config& config,
+                                                         const std::function<bool(const uint8_t*, size_t)>& read_callback,
+                                                         const std::function<size_t(uint8_t*, size_t)>& write_callback) {
+        libusb_device_handle* _handle = nullptr;
+        std::function<void(const stream_parameters&)> parameters_callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            _handle = handle;
+            parameters_callback = stream_parameters_callback;
+        }
+        if (!_handle) {
+            LOG_ERROR("Cannot stream: Device is not open");
+            return {};
+        }
+
+        const endpoint_info* ep = find_endpoint(endpoint);
+        if (ep && ep->transfer_type != transfer_type::BULK && ep->transfer_type != transfer_type::INTERRUPT) {
+            LOG_ERROR("Cannot stream: Endpoint 0x%02X is neither a bulk nor an interrupt endpoint", endpoint);
+            return {};
+        }
+        bool interrupt = ep && ep->transfer_type == transfer_type::INTERRUPT;
+        bool reading = (bool)read_callback;
+
+        size_t transfer_size = config.transfer_size;
+        if (transfer_size == LIBUSBCPP_AUTO_BUFFER_SIZE) {
+            transfer_size = recommended_buffer_size(endpoint);
+        }
+        size_t packet_size = ep && ep->max_packet_size > 0 ? ep->max_packet_size : 64;
+        if (transfer_size > config.max_memory) {    // Even a single transfer would exceed the limit
+            transfer_size = std::max(config.max_memory - config.max_memory % packet_size, packet_size);
+        }
+        int queue_depth = config.queue_depth > 0 ? config.queue_depth : (config.auto_tune ? 2 : 4);
+        while (queue_depth > 1 && transfer_size * queue_depth > config.max_memory) {
+            queue_depth--;
+        }
+
+        std::pmr::memory_resource* _resource = config.resource ? config.resource : resource;
+        stream_tuner tuner(config, transfer_size, queue_depth, packet_size);
+        std::pmr::deque<stream_slot> slots(_resource);     // Slots never move, transfers point to them
+        std::mutex completed_mutex;
+        std::condition_variable completed_cv;
+        std::pmr::vector<stream_slot*> completed(_resource);
+        std::pmr::vector<stream_slot*> processing(_resource);
+        size_t in_flight = 0;
+        bool running = true;
+        bool finished = false;      // Writing: No more data, the queued transfers are still sent
+        bool cancelled = false;
+        bool lost = false;
+
+        auto submit = [&] (stream_slot& slot) {
+            auto& params = tuner.parameters();
+            slot.buffer.resize(params.transfer_size);
+
+            int length = (int)slot.buffer.size();
+            if (!reading) {
+                TRACE_SPAN("callback", "transfer", "endpoint", endpoint);
+                length = (int)write_callback(slot.buffer.data(), slot.buffer.size());
+                if (length == 0) {
+                    finished = true;
+                    return;
+                }
+            }
+
+            if (interrupt) {
+                libusb_fill_interrupt_transfer(slot.transfer, _handle, endpoint, slot.buffer.data(), length,
+                                               on_stream_transfer_complete, &slot, config.timeout);
+            }
+            else {
+                libusb_fill_bulk_transfer(slot.transfer, _handle, endpoint, slot.buffer.data(), length,
+                                          on_stream_transfer_complete, &slot, config.timeout);
+            }
+
+            slot.submitted = steady_clock::now();
+#ifdef LIBUSBCPP_TRACING
+            slot.trace_submitted = trace::active.load(std::memory_order_relaxed) ? trace::now() : 0;
+#endif
+            TRACE_SPAN("submit", "transfer", "endpoint", endpoint);
+            int status = libusb_submit_transfer(slot.transfer);
+            if (status != LIBUSB_SUCCESS) {
+                LOG_ERROR("Failed to submit transfer on endpoint 0x%02X: %s", endpoint, libusb_strerror(status));
+                lost = status == LIBUSB_ERROR_NO_DEVICE;
+                running = false;
+                return;
+            }
+            slot.in_flight = true;
+            in_flight++;
+        };
+
+        auto fill_queue = [&] {
+            for (size_t i = 0; running && !finished && in_flight < (size_t)tuner.parameters().queue_depth; i++) {
+                if (i == slots.size()) {
+                    libusb_transfer* transfer = libusb_alloc_transfer(0);
+                    if (!transfer) {
+                        LOG_ERROR("Failed to allocate transfer");
+                        running = false;
+                        return;
+                    }
+                    auto& slot = slots.emplace_back(_resource);
+                    slot.transfer = transfer;
+                    slot.completed_mutex = &completed_mutex;
+                    slot.completed_cv = &completed_cv;
+                    slot.completed = &completed;
+                }
+                if (!slots[i].in_flight) {
+                    submit(slots[i]);
+                }
+            }
+        };
+
+        fill_queue();
+        while (in_flight > 0) {
+            if (config.handle_events) {
+                struct timeval tv = { 0, 100000 };
+                int status = libusb_handle_events_timeout_completed(context, &tv, nullptr);
+                if (status != LIBUSB_SUCCESS && status != LIBUSB_ERROR_INTERRUPTED) {
+                    LOG_ERROR("Failed to handle libusb events: %s", libusb_strerror(status));
+                    running = false;
+                }
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(completed_mutex);
+                if (!config.handle_events) {
+                    completed_cv.wait_for(lock, std::chrono::milliseconds(100), [&] { return !completed.empty(); });
+                }
+                std::swap(processing, completed);
+            }
+
+            auto now = steady_clock::now();
+            for (stream_slot* slot : processing) {
+                slot->in_flight = false;
+                in_flight--;
+
+                libusb_transfer* transfer = slot->transfer;
+                switch (transfer->status) {
+                    case LIBUSB_TRANSFER_TIMED_OUT:
+                        if (!reading) {     // Part of the data may have been sent, resubmitting would reorder it
+                            LOG_ERROR("Write transfer on endpoint 0x%02X timed out", endpoint);
+                            running = false;
+                            break;
+                        }
+                        // A read timeout simply means no data arrived in time, the transfer is resubmitted
+                        tuner.on_timeout(now);
+                        if (running) {
+                            TRACE_SPAN("callback", "transfer", "bytes", (uint64_t)transfer->actual_length);
+                            running = read_callback(transfer->buffer, transfer->actual_length);
+                        }
+                        break;
+
+                    case LIBUSB_TRANSFER_COMPLETED:
+                        if (!running)
+                            break;
+                        if (!reading && transfer->actual_length < transfer->length) {
+                            LOG_ERROR("Short write on endpoint 0x%02X: %d of %d bytes sent", endpoint,
+                                      transfer->actual_length, transfer->length);
+                            running = false;
+                            break;
+                        }
+                        if (reading && transfer->actual_length > 0) {
+                            TRACE_SPAN("callback", "transfer", "bytes", (uint64_t)transfer->actual_length);
+                            if (!read_callback(transfer->buffer, transfer->actual_length)) {
+                                running = false;
+                                break;
+                            }
+                        }
+                        if (tuner.on_completion(transfer->actual_length, slot->submitted, now) && parameters_callback) {
+                            parameters_callback(tuner.measurement());
+                        }
+                        break;
+
+                    case LIBUSB_TRANSFER_CANCELLED:
+                        break;
+
+                    case LIBUSB_TRANSFER_NO_DEVICE:
+                        lost = true;
+                        running = false;
+                        break;
+
+                    default:
+                        LOG_ERROR("Transfer on endpoint 0x%02X failed with status %d", endpoint, transfer->status);
+                        running = false;
+                        break;
+                }
+            }
+            processing.clear();
+
+            if (running) {
+                fill_queue();
+            }
+            else if (!cancelled) {     // Errors and a read callback returning false, the end of data lets them finish
+                cancelled = true;
+                for (auto& slot : slots) {
+                    if (slot.in_flight) {
+                        libusb_cancel_transfer(slot.transfer);
+                    }
+                }
+            }
+        }
+
+        for (auto& slot : slots) {
+            libusb_free_transfer(slot.transfer);
+        }
+
+        if (lost) {
+            std::lock_guard<std::mutex> lock(mutex);
+            lost_connection();
+        }
+        return tuner.parameters();
+    }
+
+}
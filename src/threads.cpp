@@ -0,0 +1,125 @@
+#include <utility>
+#include <algorithm>
+#include <cstring>
+#include "log.h"
+
+#define LIBUSBCPP_EXPORTS
+#include "libusbcpp.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace usb {
+
+    static bool valid_cpus(const thread_config& config, size_t cpu_count, const std::string& name) {
+        for (int cpu : config.cpus) {
+            if (cpu < 0 || (size_t)cpu >= cpu_count) {
+                LOG_ERROR("CPU %d is out of range for thread %s, ignoring the affinity", cpu, name.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool configure_native(std::thread::native_handle_type handle, const thread_config& config,
+                                 const std::string& role) {
+        bool success = true;
+        std::string name = (config.name.empty() ? "usb" : config.name) + "-" + role;
+
+#ifdef _WIN32
+        SetThreadDescription((HANDLE)handle, std::wstring(name.begin(), name.end()).c_str());
+
+        if (!valid_cpus(config, 8 * sizeof(DWORD_PTR), name)) {
+            success = false;
+        }
+        else if (!config.cpus.empty()) {
+            DWORD_PTR mask = 0;
+            for (int cpu : config.cpus) {
+                mask |= (DWORD_PTR)1 << cpu;
+            }
+            if (SetThreadAffinityMask((HANDLE)handle, mask) == 0) {
+                LOG_ERROR("Failed to set the CPU affinity of thread %s", name.c_str());
+                success = false;
+            }
+        }
+
+        // No real-time classes for single threads on Windows. DEFAULT also undoes an earlier real-time config.
+        int priority = THREAD_PRIORITY_NORMAL;
+        if (config.policy != thread_policy::DEFAULT) {
+            priority = config.priority >= 90 ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+        }
+        if (!SetThreadPriority((HANDLE)handle, priority)) {
+            LOG_ERROR("Failed to set the priority of thread %s", name.c_str());
+            success = false;
+        }
+#else
+    #ifdef __linux__
+        pthread_setname_np(handle, name.substr(0, 15).c_str());    // Linux limits names to 15 characters
+
+        if (!valid_cpus(config, CPU_SETSIZE, name)) {
+            success = false;
+        }
+        else if (!config.cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : config.cpus) {
+                CPU_SET(cpu, &set);
+            }
+            int status = pthread_setaffinity_np(handle, sizeof(set), &set);
+            if (status != 0) {
+                LOG_ERROR("Failed to set the CPU affinity of thread %s: %s", name.c_str(), strerror(status));
+                success = false;
+            }
+        }
+    #else
+        if (!config.cpus.empty()) {
+            LOG_WARN("CPU affinity is not supported on this platform, ignoring it for thread %s", name.c_str());
+        }
+    #endif
+
+        // DEFAULT also undoes an earlier real-time config
+        sched_param param {};
+        int policy = SCHED_OTHER;
+        if (config.policy != thread_policy::DEFAULT) {
+            param.sched_priority = config.priority;
+            policy = config.policy == thread_policy::FIFO ? SCHED_FIFO : SCHED_RR;
+        }
+        int status = pthread_setschedparam(handle, policy, &param);
+        if (status != 0) {
+            LOG_ERROR("Failed to set the scheduling policy of thread %s: %s", name.c_str(), strerror(status));
+            success = false;
+        }
+#endif
+        return success;
+    }
+
+    LIBUSBCPP_API bool configure_thread(std::thread& thread, const thread_config& config, const std::string& role) {
+        if (!thread.joinable())
+            return false;
+        return configure_native(thread.native_handle(), config, role);
+    }
+
+    LIBUSBCPP_API bool configure_this_thread(const thread_config& config, const std::string& role) {
+#ifdef _WIN32
+        return configure_native((std::thread::native_handle_type)GetCurrentThread(), config, role);
+#else
+        return configure_native(pthread_self(), config, role);
+#endif
+    }
+
+    LIBUSBCPP_API void wakeup_jitter::add(std::chrono::steady_clock::duration lateness) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(lateness);
+        wakeups++;
+        total += us;
+        max = std::max(max, us);
+    }
+
+    LIBUSBCPP_API std::chrono::microseconds wakeup_jitter::mean() const {
+        return wakeups > 0 ? total / (int64_t)wakeups : std::chrono::microseconds(0);
+    }
+
+}
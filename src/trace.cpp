@@ -0,0 +1,240 @@
+#include <utility>
+#include <algorithm>
+#include <cstdio>
+#include "log.h"
+
+#define LIBUSBCPP_EXPORTS
+#include "libusbcpp_trace.h"
+
+#if defined(LIBUSBCPP_TRACING) && defined(__linux__)
+#include <pthread.h>
+#endif
+
+namespace usb::trace {
+
+    LIBUSBCPP_API std::atomic<bool> active = false;
+
+#ifdef LIBUSBCPP_TRACING
+
+    struct event {
+        const char* name;
+        const char* category;
+        const char* arg_name;
+        uint64_t arg;
+        uint64_t begin;
+        uint64_t end;
+        uint64_t id;        // Async events only
+        bool async;
+    };
+
+    // Written only by its own thread. Readers see the first 'count' events, which are never modified again.
+    struct thread_buffer {
+        std::vector<event> events;
+        std::atomic<size_t> count = 0;
+        std::atomic<uint64_t> dropped = 0;
+        std::atomic<uint64_t> generation = 0;   // Buffers of an older generation belong to an earlier trace
+        uint32_t thread_id = 0;
+        std::string thread_name;
+    };
+
+    static std::mutex registry_mutex;           // Only taken when a thread records its very first event
+    static std::vector<std::shared_ptr<thread_buffer>> buffers;    // Kept after the threads exit until start()
+    static uint32_t next_thread_id = 1;
+
+    // Held by to_json() while it reads buffers of the current trace and by start(), which ends that trace. Buffers
+    // are only reset once they belong to an older trace, so none is ever reset while it is being read.
+    static std::mutex export_mutex;
+    static std::atomic<uint64_t> current_generation = 0;
+    static std::atomic<size_t> capacity = 0;
+    static std::atomic<int64_t> epoch = 0;      // [ns] steady_clock at start()
+
+    static thread_local std::shared_ptr<thread_buffer> local_buffer;
+
+    static thread_buffer& get_buffer() {
+        if (!local_buffer) {
+            local_buffer = std::make_shared<thread_buffer>();
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            local_buffer->thread_id = next_thread_id++;
+            buffers.push_back(local_buffer);
+        }
+
+        // The first event after start() resets the buffer, so no other thread ever touches it
+        thread_buffer& buffer = *local_buffer;
+        uint64_t generation = current_generation.load(std::memory_order_acquire);
+        if (buffer.generation.load(std::memory_order_relaxed) != generation) {
+            buffer.count.store(0, std::memory_order_relaxed);
+            buffer.dropped.store(0, std::memory_order_relaxed);
+            buffer.events.resize(capacity.load(std::memory_order_relaxed));
+#ifdef __linux__
+            char name[16] = {};
+            if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) {
+                buffer.thread_name = name;
+            }
+#endif
+            buffer.generation.store(generation, std::memory_order_release);
+        }
+        return buffer;
+    }
+
+    static void push(const event& e) {
+        thread_buffer& buffer = get_buffer();
+        size_t count = buffer.count.load(std::memory_order_relaxed);
+        if (count == buffer.events.size()) {
+            buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        buffer.events[count] = e;
+        buffer.count.store(count + 1, std::memory_order_release);
+    }
+
+    LIBUSBCPP_API void start(size_t events_per_thread) {
+        std::lock_guard<std::mutex> export_lock(export_mutex);
+        {
+            // The events of exited threads are discarded now, only their thread_local still held the buffers
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [] (const auto& buffer) {
+                return buffer.use_count() == 1;
+            }), buffers.end());
+        }
+        capacity = events_per_thread;
+        epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        current_generation.fetch_add(1, std::memory_order_release);
+        active = true;
+    }
+
+    LIBUSBCPP_API void stop() {
+        active = false;
+    }
+
+    LIBUSBCPP_API uint64_t now() {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        return (uint64_t)(ns - epoch.load(std::memory_order_relaxed));
+    }
+
+    LIBUSBCPP_API void record(const char* name, const char* category, uint64_t begin, uint64_t end,
+                              const char* arg_name, uint64_t arg) {
+        push({ name, category, arg_name, arg, begin, end, 0, false });
+    }
+
+    LIBUSBCPP_API void record_async(const char* name, const char* category, uint64_t id, uint64_t begin, uint64_t end,
+                                    const char* arg_name, uint64_t arg) {
+        push({ name, category, arg_name, arg, begin, end, id, true });
+    }
+
+    static void append_escaped(std::string& out, const char* text) {
+        for (; *text; text++) {
+            if (*text == '"' || *text == '\\') {
+                out += '\\';
+            }
+            if ((unsigned char)*text >= 0x20) {
+                out += *text;
+            }
+        }
+    }
+
+    static void append_event(std::string& out, const event& e, const char* phase, uint64_t ts, uint32_t tid,
+                             bool with_duration) {
+        char number[96];
+        out += out.back() == '[' ? "\n{\"name\":\"" : ",\n{\"name\":\"";
+        append_escaped(out, e.name);
+        out += "\",\"cat\":\"";
+        append_escaped(out, e.category);
+        snprintf(number, sizeof(number), "\",\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f", phase, tid, ts / 1e3);
+        out += number;
+        if (with_duration) {
+            snprintf(number, sizeof(number), ",\"dur\":%.3f", (e.end - e.begin) / 1e3);
+            out += number;
+        }
+        if (e.async) {
+            snprintf(number, sizeof(number), ",\"id\":\"0x%llx\"", (unsigned long long)e.id);
+            out += number;
+        }
+        if (e.arg_name) {
+            out += ",\"args\":{\"";
+            append_escaped(out, e.arg_name);
+            snprintf(number, sizeof(number), "\":%llu}", (unsigned long long)e.arg);
+            out += number;
+        }
+        out += "}";
+    }
+
+    LIBUSBCPP_API std::string to_json() {
+        std::lock_guard<std::mutex> export_lock(export_mutex);
+        std::vector<std::shared_ptr<thread_buffer>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            snapshot = buffers;
+        }
+
+        std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        uint64_t generation = current_generation.load(std::memory_order_acquire);
+        for (const auto& buffer : snapshot) {
+            if (buffer->generation.load(std::memory_order_acquire) != generation)
+                continue;   // Nothing recorded by this thread in the current trace
+            size_t count = buffer->count.load(std::memory_order_acquire);
+
+            char number[64];
+            snprintf(number, sizeof(number), "\"ph\":\"M\",\"pid\":1,\"tid\":%u,", buffer->thread_id);
+            out += out.back() == '[' ? "\n{\"name\":\"thread_name\"," : ",\n{\"name\":\"thread_name\",";
+            out += number;
+            out += "\"args\":{\"name\":\"";
+            append_escaped(out, buffer->thread_name.empty() ? "thread" : buffer->thread_name.c_str());
+            out += "\"}}";
+
+            for (size_t i = 0; i < count; i++) {
+                const event& e = buffer->events[i];
+                if (e.async) {
+                    append_event(out, e, "b", e.begin, buffer->thread_id, false);
+                    append_event(out, e, "e", e.end, buffer->thread_id, false);
+                }
+                else {
+                    append_event(out, e, "X", e.begin, buffer->thread_id, true);
+                }
+            }
+        }
+        out += "\n]}\n";
+        return out;
+    }
+
+    LIBUSBCPP_API uint64_t dropped() {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        uint64_t generation = current_generation.load(std::memory_order_acquire);
+        uint64_t total = 0;
+        for (const auto& buffer : buffers) {
+            if (buffer->generation.load(std::memory_order_acquire) == generation) {
+                total += buffer->dropped.load(std::memory_order_relaxed);
+            }
+        }
+        return total;
+    }
+
+#else   // Tracing is not compiled in, nothing is ever recorded
+
+    LIBUSBCPP_API void start(size_t) {
+        LOG_WARN("Tracing is not available, build libusbcpp with the LIBUSBCPP_TRACING option");
+    }
+
+    LIBUSBCPP_API void stop() {}
+    LIBUSBCPP_API uint64_t now() { return 0; }
+    LIBUSBCPP_API void record(const char*, const char*, uint64_t, uint64_t, const char*, uint64_t) {}
+    LIBUSBCPP_API void record_async(const char*, const char*, uint64_t, uint64_t, uint64_t, const char*, uint64_t) {}
+    LIBUSBCPP_API std::string to_json() { return "{\"traceEvents\":[]}\n"; }
+    LIBUSBCPP_API uint64_t dropped() { return 0; }
+
+#endif
+
+    LIBUSBCPP_API bool save(const std::string& path) {
+        std::FILE* file = fopen(path.c_str(), "wb");
+        if (!file) {
+            LOG_ERROR("Cannot open '%s' to save the trace", path.c_str());
+            return false;
+        }
+        std::string json = to_json();
+        bool success = fwrite(json.data(), 1, json.size(), file) == json.size();
+        fclose(file);
+        return success;
+    }
+
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "libusbcpp_trace.h"
+
+// Spans inside the library only exist when tracing is compiled in
+#ifdef LIBUSBCPP_TRACING
+    #define TRACE_CONCAT_INNER(a, b) a##b
+    #define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+    #define TRACE_SPAN(...) usb::trace::span TRACE_CONCAT(trace_span_, __LINE__)(__VA_ARGS__)
+#else
+    #define TRACE_SPAN(...) ((void)0)
+#endif
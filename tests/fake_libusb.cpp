@@ -0,0 +1,271 @@
+// In-memory stand-in for libusb, so the tests run without any hardware. It implements exactly the functions
+// libusbcpp uses: Two high-speed devices 1209:0D32 and 1209:0D33 on bus 1, each with one interface and a bulk
+// endpoint pair 0x81/0x01. Bulk reads return a counting pattern, asynchronous transfers complete one per call to
+// libusb_handle_events_timeout_completed() in the order they were submitted. Tests check what was sent with
+// fake_libusb_bytes_written(). Like libusb it only allocates with malloc, so tests can count the allocations of
+// libusbcpp itself with a replaced operator new.
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include "libusb.h"
+
+struct libusb_context {
+    int unused;
+};
+
+struct libusb_device {
+    uint16_t product_id;
+    uint8_t address;
+    uint8_t port;
+    const char* description;
+};
+
+struct libusb_device_handle {
+    libusb_device* device;
+};
+
+static libusb_device devices[] = {
+    { 0x0D32, 2, 1, "libusbcpp test device with a description longer than any small string buffer" },
+    { 0x0D33, 3, 2, "libusbcpp second test device" },
+};
+static constexpr int device_count = sizeof(devices) / sizeof(devices[0]);
+
+static const libusb_endpoint_descriptor endpoints[] = {
+    { LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x81, LIBUSB_TRANSFER_TYPE_BULK, 512, 0, 0, 0, nullptr, 0 },
+    { LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x01, LIBUSB_TRANSFER_TYPE_BULK, 512, 0, 0, 0, nullptr, 0 },
+};
+static const libusb_interface_descriptor altsetting = {
+    LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 0, 2, LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0, endpoints, nullptr, 0
+};
+static const libusb_interface interfaces[] = { { &altsetting, 1 } };
+static libusb_config_descriptor configuration = {
+    LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG, 0, 1, 1, 0, 0x80, 50, interfaces, nullptr, 0
+};
+
+static std::mutex transfer_mutex;
+static libusb_transfer* pending[1024];
+static size_t pending_count = 0;
+static std::atomic<size_t> bytes_written = 0;     // By completed OUT transfers, synchronous or not
+
+static void fill_pattern(unsigned char* data, int length) {
+    for (int i = 0; i < length; i++) {
+        data[i] = (unsigned char)i;
+    }
+}
+
+extern "C" {
+
+int LIBUSB_CALL libusb_init(libusb_context** context) {
+    if (context) {
+        *context = (libusb_context*)calloc(1, sizeof(libusb_context));
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context* context) {
+    free(context);     // nullptr for the default context
+}
+
+const char* LIBUSB_CALL libusb_strerror(int) {
+    return "fake libusb error";
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context*, libusb_device*** list) {
+    auto** result = (libusb_device**)malloc((device_count + 1) * sizeof(libusb_device*));
+    for (int i = 0; i < device_count; i++) {
+        result[i] = &devices[i];
+    }
+    result[device_count] = nullptr;
+    *list = result;
+    return device_count;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device** list, int) {
+    free(list);
+}
+
+libusb_device* LIBUSB_CALL libusb_ref_device(libusb_device* device) {
+    return device;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device*) {
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device* device, libusb_device_descriptor* descriptor) {
+    memset(descriptor, 0, sizeof(*descriptor));
+    descriptor->bLength = LIBUSB_DT_DEVICE_SIZE;
+    descriptor->bDescriptorType = LIBUSB_DT_DEVICE;
+    descriptor->bcdUSB = 0x0200;
+    descriptor->bMaxPacketSize0 = 64;
+    descriptor->idVendor = 0x1209;
+    descriptor->idProduct = device->product_id;
+    descriptor->iProduct = 1;
+    descriptor->iSerialNumber = 2;
+    descriptor->bNumConfigurations = 1;
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_get_active_config_descriptor(libusb_device*, libusb_config_descriptor** config) {
+    *config = &configuration;
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_free_config_descriptor(libusb_config_descriptor*) {
+}
+
+int LIBUSB_CALL libusb_get_ss_endpoint_companion_descriptor(libusb_context*, const libusb_endpoint_descriptor*,
+                                                            libusb_ss_endpoint_companion_descriptor**) {
+    return LIBUSB_ERROR_NOT_FOUND;      // High-speed devices have none
+}
+
+void LIBUSB_CALL libusb_free_ss_endpoint_companion_descriptor(libusb_ss_endpoint_companion_descriptor*) {
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device*) {
+    return 1;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device* device) {
+    return device->address;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device* device, uint8_t* port_numbers, int length) {
+    if (length < 2)
+        return LIBUSB_ERROR_OVERFLOW;
+    port_numbers[0] = 4;                // Both devices sit behind the hub on root port 4
+    port_numbers[1] = device->port;
+    return 2;
+}
+
+int LIBUSB_CALL libusb_get_device_speed(libusb_device*) {
+    return LIBUSB_SPEED_HIGH;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device* device, libusb_device_handle** handle) {
+    *handle = (libusb_device_handle*)malloc(sizeof(libusb_device_handle));
+    (*handle)->device = device;
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle* handle) {
+    free(handle);
+}
+
+libusb_device* LIBUSB_CALL libusb_get_device(libusb_device_handle* handle) {
+    return handle->device;
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle* handle, uint8_t index,
+                                                   unsigned char* data, int length) {
+    char serial[16];
+    snprintf(serial, sizeof(serial), "SN%04X", handle->device->product_id);
+    const char* text = index == 2 ? serial : handle->device->description;
+    int size = (int)strlen(text);
+    if (size >= length)
+        return LIBUSB_ERROR_OVERFLOW;
+    memcpy(data, text, size + 1);
+    return size;
+}
+
+int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle*, int) {
+    return 0;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle*, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle*, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle*, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle*, unsigned char endpoint, unsigned char* data, int length,
+                                     int* transferred, unsigned int) {
+    if (endpoint & LIBUSB_ENDPOINT_IN) {
+        fill_pattern(data, length);
+    }
+    else {
+        bytes_written += length;
+    }
+    *transferred = length;
+    return LIBUSB_SUCCESS;
+}
+
+libusb_transfer* LIBUSB_CALL libusb_alloc_transfer(int iso_packets) {
+    return (libusb_transfer*)calloc(1, sizeof(libusb_transfer) + iso_packets * sizeof(libusb_iso_packet_descriptor));
+}
+
+void LIBUSB_CALL libusb_free_transfer(libusb_transfer* transfer) {
+    free(transfer);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(libusb_transfer* transfer) {
+    std::lock_guard<std::mutex> lock(transfer_mutex);
+    if (pending_count == sizeof(pending) / sizeof(pending[0]))
+        return LIBUSB_ERROR_BUSY;
+    pending[pending_count++] = transfer;
+    return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(libusb_transfer* transfer) {
+    {
+        std::lock_guard<std::mutex> lock(transfer_mutex);
+        auto* end = pending + pending_count;
+        auto* it = std::find(pending, end, transfer);
+        if (it == end)
+            return LIBUSB_ERROR_NOT_FOUND;
+        std::copy(it + 1, end, it);
+        pending_count--;
+    }
+    transfer->status = LIBUSB_TRANSFER_CANCELLED;
+    transfer->actual_length = 0;
+    transfer->callback(transfer);
+    return LIBUSB_SUCCESS;
+}
+
+// Completes the oldest pending transfer only, so the others are still in flight when the stream reacts to it
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context*, struct timeval*, int*) {
+    libusb_transfer* transfer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(transfer_mutex);
+        if (pending_count > 0) {
+            transfer = pending[0];
+            std::copy(pending + 1, pending + pending_count, pending);
+            pending_count--;
+        }
+    }
+    if (!transfer) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return LIBUSB_SUCCESS;
+    }
+
+    if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+        fill_pattern(transfer->buffer, transfer->length);
+    }
+    else {
+        bytes_written += transfer->length;
+    }
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    transfer->actual_length = transfer->length;
+    transfer->callback(transfer);
+    return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context*) {
+}
+
+}
+
+size_t fake_libusb_bytes_written() {
+    return bytes_written;
+}
@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <cstdlib>
+#include <array>
+#include "libusbcpp.h"
+
+// Once the buffers are prepared, the allocator-aware API must not touch the global heap: Every call to the global
+// operator new is counted while devices are opened, scanned and read from. Runs against the fake libusb backend.
+
+static std::atomic<size_t> global_allocations = 0;
+
+void* operator new(size_t size) {
+    global_allocations++;
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main() {
+    usb::context context;
+
+    static std::array<std::byte, 1024 * 1024> arena;
+    std::pmr::monotonic_buffer_resource upstream(arena.data(), arena.size(), std::pmr::null_memory_resource());
+    std::pmr::unsynchronized_pool_resource pool(&upstream);
+
+    // Device objects, their descriptions and their cached configuration come from the pool
+    size_t before = global_allocations;
+    auto found = usb::pmr::find_devices(0x1209, 0x0D32, &pool, context);
+    check(found.size() == 1, "find_devices finds the test device");
+    check(global_allocations == before, "find_devices does not allocate from the global heap");
+    if (found.empty())
+        return 1;
+
+    usb::device device = found.front();
+    check(device->info.description.get_allocator().resource() == &pool, "the description uses the pool");
+    check(device->info.description.size() > 32, "the description is longer than a small string buffer");
+
+    before = global_allocations;
+    const usb::endpoint_info* ep = device->find_endpoint(usb::transfer_type::BULK, usb::direction::IN);
+    check(ep != nullptr, "the bulk IN endpoint is found");
+    check(global_allocations == before, "parsing the configuration does not allocate from the global heap");
+    if (!ep)
+        return 1;
+
+    // Prepare the buffers once, then the steady state must not allocate at all
+    std::pmr::vector<usb::pmr::device_info> devices(&pool);
+    size_t count = usb::pmr::scan_devices(devices, context);
+    check(count == 2, "scan_devices finds both test devices");
+    std::array<uint8_t, 4096> buffer {};
+
+    before = global_allocations;
+    size_t received = 0;
+    for (int i = 0; i < 100; i++) {
+        count = usb::pmr::scan_devices(devices, context);
+        received += device->bulk_read_into(ep->address, buffer.data(), buffer.size(), 10);
+        std::pmr::string data = device->bulk_read_pmr(ep->address, &pool, LIBUSBCPP_AUTO_BUFFER_SIZE, 10);
+        received += data.size();
+    }
+    size_t allocations = global_allocations - before;
+
+    check(count == 2 && devices.size() >= count, "repeated scans keep finding both devices");
+    check(received > 100 * buffer.size(), "both bulk_read variants return data");
+    check(allocations == 0, "the steady-state loop does not allocate from the global heap");
+
+    printf("%zu global allocations in the steady-state loop, %zu bytes received\n", allocations, received);
+    return failures == 0 ? 0 : 1;
+}
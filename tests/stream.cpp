@@ -0,0 +1,58 @@
+#include <cstdio>
+#include "libusbcpp.h"
+
+// Asynchronous streams against the fake libusb backend: A write stream that runs out of data must still send
+// everything it queued, a read stream ends when its callback returns false and cancels the transfers in flight.
+
+size_t fake_libusb_bytes_written();
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main() {
+    usb::context context;
+    usb::device device = usb::find_first_device(0x1209, 0x0D32, context);
+    check((bool)device, "the test device is found");
+    if (!device)
+        return 1;
+
+    usb::stream_config config;
+    config.transfer_size = 4096;
+    config.queue_depth = 8;
+    config.auto_tune = false;
+
+    // Every chunk handed to the stream must be sent, including the ones still in flight when the data runs out
+    size_t chunks = 0;
+    size_t before = fake_libusb_bytes_written();
+    device->stream_write(0x01, [&] (uint8_t* buffer, size_t capacity) {
+        if (chunks == 100)
+            return (size_t)0;
+        buffer[0] = (uint8_t)chunks++;
+        return capacity;
+    }, config);
+    size_t written = fake_libusb_bytes_written() - before;
+    check(chunks == 100, "the write callback is asked for all chunks");
+    check(written == 100 * config.transfer_size, "the queued writes are sent when the data runs out");
+
+    // The counting pattern arrives in every transfer, returning false ends the stream
+    size_t transfers = 0;
+    bool pattern = true;
+    device->stream_read(0x81, [&] (const uint8_t* data, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            pattern &= data[i] == (uint8_t)i;
+        }
+        return ++transfers < 50;
+    }, config);
+    check(transfers == 50, "the read stream ends when the callback returns false");
+    check(pattern, "the read stream delivers the received data");
+    check(device->is_open(), "cancelling the remaining transfers keeps the device open");
+
+    printf("%zu bytes written, %zu read transfers\n", written, transfers);
+    return failures == 0 ? 0 : 1;
+}